@@ -99,6 +99,34 @@ bool point_in_triangle (float2 pt, float2 v1, float2 v2, float2 v3)
     return ((b1 == b2) && (b2 == b3));
 }
 
+// Rotation of rows is read from constant memory unless it is larger than the device allows.
+#ifdef ROTATION_GLOBAL
+#define ROTATION_SPACE __global
+#else
+#define ROTATION_SPACE __constant
+#endif
+
+/**
+ * Rotation matrix of a row in row major order.
+ * With ROTATION_QUATERNION, each row has a unit quaternion (x,y,z,w) instead of 9 elements of the matrix.
+ */
+void get_rotation_matrix(ROTATION_SPACE const float* rotation, int row, float R[9])
+{
+#ifdef ROTATION_QUATERNION
+   float4 q = vload4(row, rotation);
+   float xx = q.x*q.x, yy = q.y*q.y, zz = q.z*q.z;
+   float xy = q.x*q.y, xz = q.x*q.z, yz = q.y*q.z;
+   float xw = q.x*q.w, yw = q.y*q.w, zw = q.z*q.w;
+   R[0] = 1.f-2.f*(yy+zz); R[1] = 2.f*(xy-zw);     R[2] = 2.f*(xz+yw);
+   R[3] = 2.f*(xy+zw);     R[4] = 1.f-2.f*(xx+zz); R[5] = 2.f*(yz-xw);
+   R[6] = 2.f*(xz-yw);     R[7] = 2.f*(yz+xw);     R[8] = 1.f-2.f*(xx+yy);
+#else
+   for(int i=0;i<9;++i){
+      R[i] = rotation[9*row+i];
+   }
+#endif
+}
+
 float2 warp(
    float2 p, float2 p_shift
 ){
@@ -111,21 +139,36 @@ float2 warp_zoom(
    return p*p_ratio;
 }
 
+/**
+ * Undistorted normalized coordinates of a pixel, bilinearly interpolated from UndistortionTable.
+ */
+float2 undistort_table(
+   float2 p,                              // UV coordinate position in a image.
+   __global const float2* table,          // Undistorted coordinates sampled every table_step pixels.
+   int table_cols, int table_rows, int table_step
+){
+   float2 t = p / (float)table_step;
+   int2 ij = clamp(convert_int2(floor(t)), (int2)(0,0), (int2)(table_cols-2,table_rows-2));
+   float2 a = t - convert_float2(ij);
+   __global const float2* top = table + ij.y*table_cols + ij.x;
+   __global const float2* bottom = top + table_cols;
+   return mix(mix(top[0], top[1], a.x), mix(bottom[0], bottom[1], a.x), a.y);
+}
+
 float2 warp_undistort(
    float2 p,                              // UV coordinate position in a image.
    float zoom_ratio,
-   __constant float* rotation_matrix,       // Rotation Matrix in each rows.
-   float k1, float k2,float p1, float p2, // Distortion parameters.
+   ROTATION_SPACE const float* rotation_matrix, // Rotation in each rows.
+   int rows,
+   __global const float2* table, int table_cols, int table_rows, int table_step, // Undistortion table.
    float2 f, float2 c
 ){
-   float2 x1 = (p-c)/f;// (float2)((u - cx)/fx,(v-cy)/fy,1.f);
-   float r2 = dot(x1,x1);
-   float2 x2 = x1*(1.f + k1*r2+k2*r2*r2);
-   x2 += (float2)(2.f*p1*x1[0]*x1[1]+p2*(r2+2.f*x1[0]*x1[0]), p1*(r2+2.f*x1[1]*x1[1])+2.f*p2*x1[0]*x1[1]);
+   float2 x2 = undistort_table(p, table, table_cols, table_rows, table_step);
    //折り返しの話はとりあえずスキップ
 
    float3 x3 = (float3)(x2[0],x2[1],1.0);
-   __constant float* R = rotation_matrix + convert_int( 9*p[1]);
+   float R[9];
+   get_rotation_matrix(rotation_matrix, min(convert_int(p[1]), rows-1), R);
    float3 XYZ = (float3)(R[0] * x3.x + R[1] * x3.y + R[2] * x3.z,
                          R[3] * x3.x + R[4] * x3.y + R[5] * x3.z,
                          R[6] * x3.x + R[7] * x3.y + R[8] * x3.z);
@@ -138,10 +181,9 @@ float2 warp_undistort(
 
 __kernel void stabilizer_function(
    __read_only image2d_t input, __write_only image2d_t output,
-   __constant float* rotation_matrix,       // Rotation Matrix in each rows.
-   int src_step, int src_offset,
+   ROTATION_SPACE const float* rotation_matrix, // Rotation in each rows.
    float zoom_ratio,
-   float k1, float k2,float p1, float p2, // Distortion parameters.
+   __global const float2* table, int table_cols, int table_rows, int table_step, // Undistortion table.
    float fx, float fy, float cx, float cy
 )
 {
@@ -158,10 +200,10 @@ __kernel void stabilizer_function(
    // float2 uv1 = warp_zoom(uv1_,(float2)(2.0f,2.0f));//warp_undistort(uv1_, rotation_matrix, k1, k2, p1, p2, f, c);
    // float2 uv2 = warp_zoom(uv2_,(float2)(2.0f,2.0f));//warp_undistort(uv2_, rotation_matrix, k1, k2, p1, p2, f, c);
    // float2 uv3 = warp_zoom(uv3_,(float2)(2.0f,2.0f));//warp_undistort(uv3_, rotation_matrix, k1, k2, p1, p2, f, c);
-   float2 uv0 = warp_undistort(uv0_, zoom_ratio, rotation_matrix, k1, k2, p1, p2, f, c);
-   float2 uv1 = warp_undistort(uv1_, zoom_ratio, rotation_matrix, k1, k2, p1, p2, f, c);
-   float2 uv2 = warp_undistort(uv2_, zoom_ratio, rotation_matrix, k1, k2, p1, p2, f, c);
-   float2 uv3 = warp_undistort(uv3_, zoom_ratio, rotation_matrix, k1, k2, p1, p2, f, c);
+   float2 uv0 = warp_undistort(uv0_, zoom_ratio, rotation_matrix, size.y, table, table_cols, table_rows, table_step, f, c);
+   float2 uv1 = warp_undistort(uv1_, zoom_ratio, rotation_matrix, size.y, table, table_cols, table_rows, table_step, f, c);
+   float2 uv2 = warp_undistort(uv2_, zoom_ratio, rotation_matrix, size.y, table, table_cols, table_rows, table_step, f, c);
+   float2 uv3 = warp_undistort(uv3_, zoom_ratio, rotation_matrix, size.y, table, table_cols, table_rows, table_step, f, c);
 
    
    int2 uvMin = convert_int2(floor(min(min(uv0,uv1),min(uv2,uv3))));
@@ -201,3 +243,222 @@ __kernel void stabilizer_function(
    // write_imageui(output, (int2)(get_global_id(0),get_global_id(1)),pixel);
 }
 
+// Number of fixed point iterations to find the source row, which the rotation matrix depends on.
+#define SOURCE_ROW_ITERATION 3
+
+/**
+ * Inverse of warp_undistort().
+ * The ray of an output pixel is rotated back by the transposed matrix and distorted with the
+ * original (not inverse) distortion parameters. The matrix depends on the source row,
+ * so that the row is solved by fixed point iteration starting from the output row.
+ * Returns (-1,-1) if the ray never hits the source image plane.
+ */
+float2 warp_inverse(
+   float2 uv,                             // UV coordinate position in the output image.
+   float zoom_ratio,
+   ROTATION_SPACE const float* rotation_matrix, // Rotation in each rows.
+   int rows,
+   float k1, float k2,float p1, float p2, // Distortion parameters.
+   float2 f, float2 c
+){
+   float2 x = (uv-c)/(f*zoom_ratio);
+   float2 src = uv;
+   for(int i=0;i<SOURCE_ROW_ITERATION;++i){
+      float R[9];
+      get_rotation_matrix(rotation_matrix, clamp(convert_int_rte(src.y),0,rows-1), R);
+      float3 XYZ = (float3)(R[0] * x.x + R[3] * x.y + R[6],
+                            R[1] * x.x + R[4] * x.y + R[7],
+                            R[2] * x.x + R[5] * x.y + R[8]);
+      if(XYZ.z <= 0.f){
+         return (float2)(-1.f,-1.f);
+      }
+      float2 x2 = XYZ.xy / XYZ.z;
+      float r2 = dot(x2,x2);
+      float2 x1 = x2*(1.f + k1*r2+k2*r2*r2);
+      x1 += (float2)(2.f*p1*x2[0]*x2[1]+p2*(r2+2.f*x2[0]*x2[0]), p1*(r2+2.f*x2[1]*x2[1])+2.f*p2*x2[0]*x2[1]);
+      src = x1*f+c;
+   }
+   return src;
+}
+
+/**
+ * Sample the source position uv of the frame and write it. Out of the frame is black.
+ * input is a part of the frame whose top left is src_origin, or the whole frame.
+ */
+void write_image_sample(__read_only image2d_t input, __write_only image2d_t output, int2 uvt, float2 uv, int2 src_origin, int2 frame_size)
+{
+   float4 pixel = (float4)(0.f,0.f,0.f,0.f);
+   if(all(uv >= (float2)(-0.5f,-0.5f)) && all(uv <= convert_float2(frame_size) - 0.5f)){
+      pixel = read_imagef(input, samplerLN, uv - convert_float2(src_origin) + 0.5f);
+   }
+   write_imagef(output, uvt, pixel);
+}
+
+/**
+ * Gather style stabilizer. Each work-item computes one output pixel from its source position,
+ * so that every output pixel is written exactly once regardless of zoom and rotation.
+ * Images are normalized (CL_UNORM_INT8) for hardware bilinear filtering.
+ */
+__kernel void stabilizer_function_inverse(
+   __read_only image2d_t input, __write_only image2d_t output,
+   ROTATION_SPACE const float* rotation_matrix, // Rotation in each rows.
+   float zoom_ratio,
+   float k1, float k2,float p1, float p2, // Distortion parameters, not inverse.
+   float fx, float fy, float cx, float cy
+)
+{
+   int2 size = get_image_dim(output);
+   int2 uvt = (int2)(get_global_id(0),get_global_id(1));
+   if(any(uvt >= size)) return;
+
+   int2 src_size = get_image_dim(input);
+   float2 uv = warp_inverse(convert_float2(uvt), zoom_ratio, rotation_matrix, src_size.y, k1, k2, p1, p2, (float2)(fx,fy), (float2)(cx,cy));
+   write_image_sample(input, output, uvt, uv, (int2)(0,0), src_size);
+}
+
+/**
+ * Source position of an output pixel, bilinearly interpolated from the vertices of its mesh cell.
+ */
+float2 interpolate_mesh(int2 uvt, __global const float2* mesh, int mesh_cols, int grid_size)
+{
+   int2 cell = uvt / grid_size;
+   float2 ab = convert_float2(uvt - cell * grid_size) / (float)grid_size;
+   __global const float2* top = mesh + cell.y * mesh_cols + cell.x;
+   __global const float2* bottom = top + mesh_cols;
+   return mix(mix(top[0], top[1], ab.x), mix(bottom[0], bottom[1], ab.x), ab.y);
+}
+
+/**
+ * Mesh stabilizer. Source positions are computed on the host only at the vertices of a grid
+ * and are bilinearly interpolated inside each cell, which skips the per-pixel fixed point iteration.
+ */
+__kernel void stabilizer_function_mesh(
+   __read_only image2d_t input, __write_only image2d_t output,
+   __global const float2* mesh,          // Source position of each vertex, row major.
+   int mesh_cols,
+   int grid_size
+)
+{
+   int2 size = get_image_dim(output);
+   int2 uvt = (int2)(get_global_id(0),get_global_id(1));
+   if(any(uvt >= size)) return;
+
+   float2 uv = interpolate_mesh(uvt, mesh, mesh_cols, grid_size);
+   write_image_sample(input, output, uvt, uv, (int2)(0,0), get_image_dim(input));
+}
+
+/**
+ * Bilinear sampling of a packed 8bit BGR buffer, clamped to the edge like samplerLN.
+ * uv is the pixel position, the center of the top left pixel is (0,0).
+ */
+float3 read_bgr_linear(__global const uchar* src, int src_step, int src_offset, int src_rows, int src_cols, float2 uv)
+{
+   float2 floor_uv = floor(uv);
+   float2 ab = uv - floor_uv;
+   int2 max_pos = (int2)(src_cols-1, src_rows-1);
+   int2 p0 = convert_int2(floor_uv);
+   int2 p1 = clamp(p0 + 1, (int2)(0,0), max_pos);
+   p0 = clamp(p0, (int2)(0,0), max_pos);
+   __global const uchar* row0 = src + mad24(p0.y, src_step, src_offset);
+   __global const uchar* row1 = src + mad24(p1.y, src_step, src_offset);
+   float3 top = mix(convert_float3(vload3(p0.x, row0)), convert_float3(vload3(p1.x, row0)), ab.x);
+   float3 bottom = mix(convert_float3(vload3(p0.x, row1)), convert_float3(vload3(p1.x, row1)), ab.x);
+   return mix(top, bottom, ab.y);
+}
+
+/**
+ * Sample the source position and store it to a packed 8bit BGR buffer. Out of the source is black.
+ */
+void write_bgr_sample(__global const uchar* src, int src_step, int src_offset, int src_rows, int src_cols,
+   __global uchar* dst, int dst_step, int dst_offset, int2 uvt, float2 uv)
+{
+   float3 pixel = (float3)(0.f,0.f,0.f);
+   if(all(uv >= (float2)(-0.5f,-0.5f)) && all(uv <= (float2)(src_cols,src_rows) - 0.5f)){
+      pixel = read_bgr_linear(src, src_step, src_offset, src_rows, src_cols, uv);
+   }
+   vstore3(convert_uchar3_sat_rte(pixel), uvt.x, dst + mad24(uvt.y, dst_step, dst_offset));
+}
+
+/**
+ * stabilizer_function_inverse for packed BGR buffers, the layout of cv::VideoCapture and cv::VideoWriter.
+ * No color conversion to BGRA is needed before and after the kernel.
+ */
+__kernel void stabilizer_function_inverse_bgr(
+   __global const uchar* src, int src_step, int src_offset, int src_rows, int src_cols,
+   __global uchar* dst, int dst_step, int dst_offset, int dst_rows, int dst_cols,
+   ROTATION_SPACE const float* rotation_matrix, // Rotation in each rows.
+   float zoom_ratio,
+   float k1, float k2,float p1, float p2, // Distortion parameters, not inverse.
+   float fx, float fy, float cx, float cy
+)
+{
+   int2 uvt = (int2)(get_global_id(0),get_global_id(1));
+   if(any(uvt >= (int2)(dst_cols,dst_rows))) return;
+
+   float2 uv = warp_inverse(convert_float2(uvt), zoom_ratio, rotation_matrix, src_rows, k1, k2, p1, p2, (float2)(fx,fy), (float2)(cx,cy));
+   write_bgr_sample(src, src_step, src_offset, src_rows, src_cols, dst, dst_step, dst_offset, uvt, uv);
+}
+
+/**
+ * stabilizer_function_mesh for packed BGR buffers.
+ */
+__kernel void stabilizer_function_mesh_bgr(
+   __global const uchar* src, int src_step, int src_offset, int src_rows, int src_cols,
+   __global uchar* dst, int dst_step, int dst_offset, int dst_rows, int dst_cols,
+   __global const float2* mesh,          // Source position of each vertex, row major.
+   int mesh_cols,
+   int grid_size
+)
+{
+   int2 uvt = (int2)(get_global_id(0),get_global_id(1));
+   if(any(uvt >= (int2)(dst_cols,dst_rows))) return;
+
+   float2 uv = interpolate_mesh(uvt, mesh, mesh_cols, grid_size);
+   write_bgr_sample(src, src_step, src_offset, src_rows, src_cols, dst, dst_step, dst_offset, uvt, uv);
+}
+
+/**
+ * stabilizer_function_inverse for a tile of the frame.
+ * output is the tile whose top left is (dst_x,dst_y) in the output frame, and input is the part of
+ * the source frame whose top left is (src_x,src_y) which covers all source positions of the tile.
+ * Neither of them has to fit the image size limit of the device as a whole frame.
+ */
+__kernel void stabilizer_function_inverse_tile(
+   __read_only image2d_t input, __write_only image2d_t output,
+   ROTATION_SPACE const float* rotation_matrix, // Rotation in each rows.
+   float zoom_ratio,
+   float k1, float k2,float p1, float p2, // Distortion parameters, not inverse.
+   float fx, float fy, float cx, float cy,
+   int dst_x, int dst_y,
+   int src_x, int src_y,
+   int frame_cols, int frame_rows
+)
+{
+   int2 size = get_image_dim(output);
+   int2 gid = (int2)(get_global_id(0),get_global_id(1));
+   if(any(gid >= size)) return;
+
+   float2 uv = warp_inverse(convert_float2(gid + (int2)(dst_x,dst_y)), zoom_ratio, rotation_matrix, frame_rows, k1, k2, p1, p2, (float2)(fx,fy), (float2)(cx,cy));
+   write_image_sample(input, output, gid, uv, (int2)(src_x,src_y), (int2)(frame_cols,frame_rows));
+}
+
+/**
+ * stabilizer_function_mesh for a tile of the frame. See stabilizer_function_inverse_tile.
+ */
+__kernel void stabilizer_function_mesh_tile(
+   __read_only image2d_t input, __write_only image2d_t output,
+   __global const float2* mesh,          // Source position of each vertex, row major.
+   int mesh_cols,
+   int grid_size,
+   int dst_x, int dst_y,
+   int src_x, int src_y,
+   int frame_cols, int frame_rows
+)
+{
+   int2 size = get_image_dim(output);
+   int2 gid = (int2)(get_global_id(0),get_global_id(1));
+   if(any(gid >= size)) return;
+
+   float2 uv = interpolate_mesh(gid + (int2)(dst_x,dst_y), mesh, mesh_cols, grid_size);
+   write_image_sample(input, output, gid, uv, (int2)(src_x,src_y), (int2)(frame_cols,frame_rows));
+}
@@ -35,9 +35,13 @@
 #include <stdio.h>
 #include <Eigen/Dense>
 #include <vector>
+#include <algorithm>
 #include <rotation_param.h>
+#include "undistortion_table.h"
 #include <boost/math/special_functions/bessel.hpp>
 #include <memory>
+#include <functional>
+#include "thread_pool.h"
 // Eigen::MatrixXd getFilterCoefficients
 
 void gradientLimit(Eigen::VectorXd &input, double maximum_gradient_);
@@ -47,26 +51,88 @@ void getUndistortUnrollingContour(
     int frame,
     AngularVelocityPtr angular_velocity,
     std::vector<Eigen::Array2d, Eigen::aligned_allocator<Eigen::Array2d>> &contour,
-    std::vector<std::pair<int32_t,double>> sync_table,
+    const SyncTable &sync_table,
     double zoom,
     VideoPtr video_param,
-    const Eigen::VectorXd &filter_coeffs);
+    FilterPtr filter,
+    int32_t filter_strength);
 // Eigen::VectorXd getKaiserWindow(uint32_t tap_length, uint32_t alpha, bool swap);
 
+/**
+ * @brief Tells if a frame warped with a filter strength has black space, without allocation.
+ * @details Points of getSparseContour() are undistorted into rays once at construction.
+ * An evaluation rotates the rays of each row with the correction of the row, and checks all points at once.
+ * It holds its buffers, so that each thread should use its own copy. sync_table must outlive it.
+ **/
+class BlackSpaceEvaluator
+{
+public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  BlackSpaceEvaluator(AngularVelocityPtr angular_velocity,
+                      VideoPtr video_param,
+                      FilterPtr filter,
+                      const SyncTable &sync_table,
+                      double zoom);
+  bool hasBlackSpace(int frame, int32_t filter_strength);
+  double getMinimumZoom(int frame, int32_t filter_strength);
+  size_t evaluations; // Number of hasBlackSpace() and getMinimumZoom() calls.
+
+private:
+  AngularVelocityPtr angular_velocity_;
+  FilterPtr filter_;
+  const SyncTable &sync_table_;
+  double zoom_;
+  Eigen::Array2d f_, c_, border_;   // Focal length, principal point and the last pixel of the frame.
+  Eigen::Matrix3Xd rays_;           // Undistorted points of the contour, sorted by row.
+  Eigen::Matrix3Xd rotated_rays_;   // Buffer of the rays rotated by an evaluation.
+  Eigen::Array<double, 1, Eigen::Dynamic> u_, v_; // Buffers of the projected points.
+  std::vector<int32_t> row_begin_;  // First column of each row in rays_, followed by the number of columns.
+  std::vector<double> row_delay_;   // Delay of each row from the center of the frame in frames.
+  void rotate(int frame, int32_t filter_strength);
+};
+
 bool hasBlackSpace(int frame,
                    double zoom,
                    AngularVelocityPtr angular_velocity,
                    VideoPtr video_param,
-                   Eigen::VectorXd filter_coefficients,
-                   std::vector<std::pair<int32_t,double>> &sync_table);
+                   FilterPtr filter,
+                   int32_t filter_strength,
+                   const SyncTable &sync_table);
 uint32_t bisectionMethod(int frame,
                          double zoom,
                          AngularVelocityPtr angular_velocity,
                          VideoPtr video_param,
                          FilterPtr filter,
-                         std::vector<std::pair<int32_t,double>> &sync_table,
+                         const SyncTable &sync_table,
                          int32_t minimum_filter_strength,
                          int32_t maximum_filter_strength,
                          int max_iteration = 1000, uint32_t eps = 1);
+uint32_t bisectionMethod(int frame,
+                         BlackSpaceEvaluator &evaluator,
+                         int32_t minimum_filter_strength,
+                         int32_t maximum_filter_strength,
+                         int max_iteration = 1000, uint32_t eps = 1);
+
+/**
+ * @brief State of findFilterStrength() carried over from a frame to the next one.
+ **/
+struct FilterStrengthSearch
+{
+  int32_t boundary = -1; // Steps from the weakest strength to the strongest one without black space in the last frame. -1 before the first frame.
+};
+
+uint32_t findFilterStrength(int frame,
+                            BlackSpaceEvaluator &evaluator,
+                            int32_t strongest_filter_strength,
+                            int32_t weakest_filter_strength,
+                            FilterStrengthSearch &search,
+                            int max_iteration = 1000, uint32_t eps = 1);
+
+void findFilterStrengthPath(std::vector<BlackSpaceEvaluator, Eigen::aligned_allocator<BlackSpaceEvaluator>> &evaluators,
+                            int32_t strongest_filter_strength,
+                            int32_t weakest_filter_strength,
+                            double maximum_gradient,
+                            Eigen::VectorXd &filter_strength,
+                            const std::function<void(int32_t)> &progress);
 // bool isGoodWarp(std::vector<Eigen::Array2d, Eigen::aligned_allocator<Eigen::Array2d>> &contour);
 #endif //__SO3FILTERS__H__
\ No newline at end of file
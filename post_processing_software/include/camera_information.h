@@ -37,6 +37,8 @@
 #include <string>
 #include <memory>
 #include <Eigen/Dense>
+class UndistortionTable;
+
 class CameraInformation{
 public:
     CameraInformation();
@@ -63,6 +65,7 @@ virtual ~CameraInformation() = default;
     double inverse_k2_;
     double inverse_p1_;
     double inverse_p2_;
+    std::shared_ptr<UndistortionTable> undistortion_table_; // Made by calcInverseDistortCoeff().
 };
 
 using CameraInformationPtr = std::shared_ptr<CameraInformation>;
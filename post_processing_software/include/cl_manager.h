@@ -36,8 +36,16 @@
 #include <fstream>
 #include <string>
 #include <iterator>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <opencv2/opencv.hpp>
 #include <opencv2/core/ocl.hpp>
+#include <opencv2/core/opencl/runtime/opencl_core.hpp>
 void initializeCL(cv::ocl::Context &context);
 void getKernel(const char *kernel_code_file_name, const char *kernel_function, cv::ocl::Kernel &kernel, cv::ocl::Context &context, std::string build_opt);
 
@@ -0,0 +1,79 @@
+/*************************************************************************
+*  Software License Agreement (BSD 3-Clause License)
+*  
+*  Copyright (c) 2019, Yoshiaki Sato
+*  All rights reserved.
+*  
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions are met:
+*  
+*  1. Redistributions of source code must retain the above copyright notice, this
+*     list of conditions and the following disclaimer.
+*  
+*  2. Redistributions in binary form must reproduce the above copyright notice,
+*     this list of conditions and the following disclaimer in the documentation
+*     and/or other materials provided with the distribution.
+*  
+*  3. Neither the name of the copyright holder nor the names of its
+*     contributors may be used to endorse or promote products derived from
+*     this software without specific prior written permission.
+*  
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+*  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+*  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+*  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+*  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+*  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+*  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*************************************************************************/
+#ifndef __CPU_STABILIZER_H__
+#define __CPU_STABILIZER_H__
+
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "rotation_param.h"
+#include "thread_pool.h"
+
+/**
+ * @brief CPU implementation of stabilizer_function in cl/stabilizer_kernel.cl.
+ * @details For every output pixel, the source pixel is solved through the inverse of
+ * the per-row rotation and the lens distortion. The source frame is then sampled bilinearly
+ * by cv::remap on cv::Mat, which is vectorized with AVX2 / NEON by OpenCV. Map generation runs
+ * over row tiles on the ThreadPool.
+ * If grid_size is positive, the exact warp is evaluated only on the vertices of a mesh whose
+ * cells are grid_size pixels, and source positions inside each cell are bilinearly interpolated.
+ **/
+class CpuStabilizer
+{
+public:
+  CpuStabilizer(VideoPtr video_param, double zoom, int grid_size = 0, int tile_rows = 32);
+  void warp(const cv::UMat &src, const std::vector<float> &rotation_matrix, cv::UMat &dst);
+  void warp(const cv::UMat &src, const cv::Mat &mesh, cv::UMat &dst);
+  bool getSourcePosition(const float *rotation_matrix, float u, float v, float &src_u, float &src_v) const;
+  void generateMesh(const std::vector<float> &rotation_matrix, cv::Mat &mesh) const;
+  double getMeshError(const std::vector<float> &rotation_matrix, const cv::Mat &mesh) const;
+  cv::Rect getSourceRect(const std::vector<float> &rotation_matrix, const cv::Rect &dst_rect, int margin) const;
+  cv::Rect getSourceRect(const cv::Mat &mesh, const cv::Rect &dst_rect, int margin) const;
+  int getGridSize() const;
+  cv::Size getMeshSize() const;
+
+private:
+  int32_t width_;
+  int32_t height_;
+  int grid_size_;
+  int tile_rows_;
+  float fx_, fy_, cx_, cy_;
+  float k1_, k2_, p1_, p2_; // Distortion parameters, inverse of the ones in the kernel.
+  float zoom_;
+  cv::Mat map_x_;
+  cv::Mat map_y_;
+  cv::Mat mesh_;
+  void generateMap(const std::vector<float> &rotation_matrix, int row_begin, int row_end);
+  void interpolateMap(const cv::Mat &mesh, int row_begin, int row_end);
+  void remap(const cv::UMat &src, cv::UMat &dst) const;
+};
+
+#endif //__CPU_STABILIZER_H__
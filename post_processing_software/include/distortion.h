@@ -33,8 +33,10 @@
 #define DISTORTION_H
 
 #include <stdio.h>
+#include <memory>
 #include "levenbergMarquardt.hpp"
 #include "camera_information.h"
+#include "undistortion_table.h"
 
 void calcInverseDistortCoeff(CameraInformation &camera_info);
 
@@ -34,6 +34,8 @@
 
 #include <memory>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <thread>
 #include <deque>
 #include <string>
@@ -41,6 +43,7 @@
 #include <sstream>
 #include <sys/stat.h>
 #include "rotation_param.h"
+#include "thread_pool.h"
 #include <opencv2/opencv.hpp>
 #include <deque>
 
@@ -49,6 +52,31 @@
 #include "Eigen/Dense"
 using UMatPtr = std::unique_ptr<cv::UMat>;
 
+/**
+ * @brief Recycles frame buffers between the reader, the renderer and the writer.
+ * @details Buffers are allocated only while the number of frames in flight grows,
+ * so that steady state rendering allocates no device memory.
+ **/
+class UMatPool
+{
+public:
+    UMatPool(cv::Size size, int type);
+    UMatPtr acquire();
+    void release(UMatPtr &p);
+    size_t getAllocatedCount();
+    void setFormat(cv::Size size, int type, cv::UMatUsageFlags usage = cv::USAGE_ALLOCATE_DEVICE_MEMORY);
+    int getType();
+
+private:
+    cv::Size size_;
+    int type_;
+    cv::UMatUsageFlags usage_;
+    std::vector<UMatPtr> buffers_;
+    size_t allocated_count_;
+    std::mutex mutex_;
+};
+using UMatPoolPtr = std::shared_ptr<UMatPool>;
+
 // class UMatWithMutex
 // {
 // public:
@@ -60,81 +88,94 @@ using UMatPtr = std::unique_ptr<cv::UMat>;
 
 // using UMatWithMutexPtr = std::unique_ptr<UMatWithMutex>;
 
+/**
+ * @brief Bounded queue between a producer thread and a consumer thread.
+ * @details Elements are moved through a ring buffer without a lock. A thread takes the mutex
+ * only to sleep on a full or empty queue, and the other side wakes it up only when it sleeps.
+ * close() ends the stream. The consumer gets the remaining elements, then pop() fails.
+ * push() fails after close(), so that the consumer can stop the producer as well.
+ **/
 template <typename TYPE>
 class MultiThreadQueue
 {
 public:
-    MultiThreadQueue(size_t queue_size) : max_size_(queue_size){};
+    MultiThreadQueue(size_t queue_size) : ring_(std::max<size_t>(1, queue_size)), head_(0), tail_(0), closed_(false), producer_waiting_(false), consumer_waiting_(false){};
 
-    int push(TYPE &p)
+    bool push(TYPE &p)
     {
-        while (1)
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load() >= ring_.size())
         {
-            size_t data_size;
-            {
-                std::lock_guard<std::mutex> lock(mutex);
-                data_size = data.size();
-            }
-            if (data_size < max_size_)
-            {
-                break;
-            }
-            else
-            {
-                std::this_thread::sleep_for(std::chrono::milliseconds(100));
-                // std::cout << "Waiting, data.size:" << data.size() << std::endl;
-            }
+            std::unique_lock<std::mutex> lock(mutex_);
+            producer_waiting_ = true;
+            not_full_.wait(lock, [&] { return closed_ || (tail - head_.load() < ring_.size()); });
+            producer_waiting_ = false;
         }
-
-        std::lock_guard<std::mutex> lock(mutex);
-        data.emplace(std::move(p));
-        return 0;
-    }
-
-    int get(TYPE &p)
-    {
-        std::lock_guard<std::mutex> lock(mutex);
-        p = std::move(data.front());
-        return 0;
+        if (closed_)
+        {
+            return false;
+        }
+        ring_[tail % ring_.size()] = std::move(p);
+        tail_.store(tail + 1);
+        if (consumer_waiting_.load())
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            not_empty_.notify_one();
+        }
+        return true;
     }
 
-    int pop()
+    bool pop(TYPE &p)
     {
-        std::lock_guard<std::mutex> lock(mutex);
-        if (data.empty())
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load())
         {
-            return 1;
+            std::unique_lock<std::mutex> lock(mutex_);
+            consumer_waiting_ = true;
+            not_empty_.wait(lock, [&] { return closed_ || (head != tail_.load()); });
+            consumer_waiting_ = false;
+            if (head == tail_.load())
+            {
+                return false;
+            }
         }
-        data.pop();
-        // std::cout << "data size:" << data.size() << std::endl;
-        return 0;
+        p = std::move(ring_[head % ring_.size()]);
+        head_.store(head + 1);
+        if (producer_waiting_.load())
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            not_full_.notify_one();
+        }
+        return true;
     }
 
-    bool empty()
+    void close()
     {
-        std::lock_guard<std::mutex> lock(mutex);
-        return !data.size();
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        not_full_.notify_all();
+        not_empty_.notify_all();
     }
 
-    void clear()
-    {
-        std::lock_guard<std::mutex> lock(mutex);
-        while (!data.empty())
-        {
-            data.pop();
-        }
-    }
-    // int size();
 private:
-    std::queue<TYPE> data;
-    std::mutex mutex;
-    size_t max_size_;
+    std::vector<TYPE> ring_;
+    // The counters are a cache line apart, so that they never share one. The object itself isn't aligned to a line.
+    std::atomic<size_t> head_; // Written by the consumer only.
+    char head_padding_[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> tail_; // Written by the producer only.
+    char tail_padding_[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<bool> closed_;
+    std::atomic<bool> producer_waiting_;
+    std::atomic<bool> consumer_waiting_;
+    std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
 };
 
 class MultiThreadVideoWriter
 {
 public:
-    MultiThreadVideoWriter(std::string output_pass, Video &video_param, size_t queue_size);
+    MultiThreadVideoWriter(std::string output_pass, Video &video_param, size_t queue_size, UMatPoolPtr pool = nullptr);
     ~MultiThreadVideoWriter();
     std::string output_name(char *source_name);
     static std::string getOutputName(const char *source_video_name);
@@ -142,7 +183,7 @@ public:
 
 private:
     MultiThreadQueue<UMatPtr> write_data_;
-    volatile bool is_writing;
+    UMatPoolPtr pool_;
     cv::VideoWriter video_writer;
     std::thread th1;
     void join();
@@ -152,13 +193,14 @@ private:
 class MultiThreadVideoReader
 {
 public:
-    MultiThreadVideoReader(std::string input_path,size_t queue_size);
+    MultiThreadVideoReader(std::string input_path,size_t queue_size, UMatPoolPtr pool = nullptr);
     ~MultiThreadVideoReader();
     int get(UMatPtr &p);
+    void release(UMatPtr &p);
 
 private:
     MultiThreadQueue<UMatPtr> read_data_;
-    volatile bool is_reading;
+    UMatPoolPtr pool_;
     cv::VideoCapture video_capture;
     std::thread th1;
     void join();
@@ -166,6 +208,17 @@ private:
 };
 
 using MatrixPtr = std::unique_ptr<std::vector<float>>;
+/**
+ * @brief Calculates rotations of every rows of every frames.
+ * @details Frames are split into blocks of rows which are processed as tasks of the ThreadPool.
+ * A task takes the earliest block which isn't started yet when it runs, not when it is submitted,
+ * so that blocks start in frame order however the pool orders the tasks. Every idle worker works on
+ * the frame get() is waiting for until all its blocks are started. get() returns frames in frame order.
+ * Blocks are scheduled ahead of get() by queue_size frames at most.
+ * With a positive keyframe_tolerance, rotations are calculated only on keyframe rows and the rows
+ * in between are spherically interpolated. Keyframes are added by bisection until the angular error
+ * at the middle of every interval is under keyframe_tolerance in radian.
+ **/
 class MultiThreadRotationMatrixGenerator
 {
 public:
@@ -174,8 +227,10 @@ public:
                                        FilterPtr filter,
                                        AngularVelocityPtr measured_angular_velocity,
                                        Eigen::VectorXd filter_strength,
-                                       std::vector<std::pair<int32_t,double>> sync_table,
-                                       size_t queue_size);
+                                       const SyncTable &sync_table,
+                                       size_t queue_size,
+                                       bool output_quaternion = false,
+                                       double keyframe_tolerance = 0.0);
     int get(MatrixPtr &p);
     ~MultiThreadRotationMatrixGenerator();
 
@@ -187,12 +242,35 @@ private:
     FilterPtr filter;
     AngularVelocityPtr measured_angular_velocity;
     Eigen::VectorXd filter_strength;
-    std::vector<std::pair<int32_t,double>> sync_table;
-    MultiThreadQueue<MatrixPtr> rotation_matrix_;
-    volatile bool is_reading;
-    std::thread th1;
+    SyncTable sync_table;
+    bool output_quaternion; // 4 floats (x,y,z,w) per row instead of 9 floats of the matrix.
+    size_t queue_size;
+    double keyframe_tolerance;
+    struct PendingFrame
+    {
+        MatrixPtr R;
+        int32_t remaining_blocks;
+    };
+    std::map<int32_t, PendingFrame> rotation_matrix_; // Frames being calculated or waiting for get().
+    int32_t block_rows_;
+    int32_t blocks_per_frame_;
+    int32_t total_blocks_;
+    int32_t next_block_;                              // Next block to be calculated, counted over all frames.
+    int32_t submitted_blocks_;                        // Blocks which tasks were submitted for, counted over all frames.
+    int32_t next_frame_;                              // Next frame returned by get().
+    int32_t blocks_in_flight_;                        // Blocks submitted to the thread pool and not finished yet.
+    std::mutex mutex_;
+    std::condition_variable block_done_;
+    bool is_reading;
     void join();
+    void schedule();
     void process();
+    void calculateRows(int32_t frame, int32_t begin, int32_t end, float *R);
+    Eigen::Quaterniond getCorrection(int32_t frame, int32_t row);
+    void setRotation(int32_t row, const Eigen::Quaterniond &q, float *R);
+    void interpolateRows(int32_t frame,
+                         int32_t row0, const Eigen::Quaterniond &q0,
+                         int32_t row1, const Eigen::Quaterniond &q1, float *R);
 };
 
 #endif //__MULTI_THREAD_VIDEO_WRITER_H__
\ No newline at end of file
@@ -71,16 +71,15 @@
      * @param シングルローテーションを表すベクトルを回転を表すクォータニオンへ変換
      **/
     template <typename T_num>
-    Eigen::Quaternion<T_num> Vector2Quaternion(Eigen::Vector3d w)
+    Eigen::Quaternion<T_num> Vector2Quaternion(const Eigen::Vector3d &w)
     {
         double theta = w.norm(); //sqrt(w[0]*w[0]+w[1]*w[1]+w[2]*w[2]);//回転角度を計算、normと等しい
         //0割を回避するためにマクローリン展開
         if (theta > EPS_Q)
         {
-            Eigen::Vector3d n = w.normalized(); //w * (1.0/theta);//単位ベクトルに変換
             //            double sin_theta_2 = sin(theta*0.5);
             //            return Eigen::Quaternion<T_num>(cos(theta*0.5),n[0]*sin_theta_2,n[1]*sin_theta_2,n[2]*sin_theta_2);
-            Eigen::VectorXd n_sin_theta_2 = n * sin(theta * 0.5);
+            Eigen::Vector3d n_sin_theta_2 = w * (sin(theta * 0.5) / theta); // Fixed size, no allocation.
             return Eigen::Quaternion<T_num>(cos(theta * 0.5), n_sin_theta_2[0], n_sin_theta_2[1], n_sin_theta_2[2]);
         }
         else
@@ -89,4 +88,18 @@
         }
     }
 
+    /**
+     * @brief Batch version of Vector2Quaternion().
+     * @param w Rotation vectors in rows. Columns are x, y and z, each of them is contiguous (SoA).
+     * @param q Quaternions in rows. Columns are x, y, z and w, in the order of Eigen::Quaterniond::coeffs().
+     **/
+    void Vectors2Quaternions(const Eigen::Ref<const Eigen::MatrixX3d> &w, Eigen::Ref<Eigen::MatrixX4d> q);
+
+    /**
+     * @brief Batch version of Quaternion2Vector() without unwrapping.
+     * @param q Quaternions in rows. Columns are x, y, z and w, in the order of Eigen::Quaterniond::coeffs().
+     * @param w Rotation vectors in rows. Columns are x, y and z.
+     **/
+    void Quaternions2Vectors(const Eigen::Ref<const Eigen::MatrixX4d> &q, Eigen::Ref<Eigen::MatrixX3d> w);
+
 #endif //__ROTATION_MATH_H__
\ No newline at end of file
@@ -37,10 +37,16 @@
 #include <Eigen/Dense>
 #include <memory>
 #include <map>
+#include <mutex>
 #include "camera_information.h"
 #include <iterator>
 #include <list>
+#include <tuple>
 #include <vector>
+#include <limits>
+#include <algorithm>
+#include <functional>
+#include <cmath>
 using QuaternionData = std::vector<Eigen::Quaterniond, Eigen::aligned_allocator<Eigen::Quaterniond>>;
 using QuaternionDataPtr = std::shared_ptr<std::vector<Eigen::Quaterniond, Eigen::aligned_allocator<Eigen::Quaterniond>>>;
 
@@ -85,6 +91,28 @@ public:
   CameraInformationPtr camera_info;
 };
 
+/**
+ * @brief Piecewise linear mapping from estimated angular velocity frames to measured angular velocity frames.
+ * @details Compiled once from the (estimated frame, measured frame) pairs of a sync table.
+ * Points are sorted and every segment keeps its slope and intercept. Frames before the first point
+ * and after the last point are extrapolated with the first and the last segments.
+ **/
+class SyncTable
+{
+public:
+  explicit SyncTable(std::vector<std::pair<int32_t, double>> table);
+  double operator()(double estimated_angular_velocity_frame) const;
+  const std::vector<std::pair<int32_t, double>> &getTable() const;
+
+private:
+  std::vector<std::pair<int32_t, double>> table_;
+  std::vector<double> a_; // Slope of each segment.
+  std::vector<double> b_; // Intercept of each segment.
+  size_t findSegment(double estimated_angular_velocity_frame) const;
+};
+
+class Filter;
+
 class AngularVelocity : public BaseParam
 {
 public:
@@ -95,14 +123,52 @@ public:
   Eigen::Vector3d getAngularVelocityVector(double frame);
   Eigen::Quaterniond getAngularVelocity(size_t frame);
   Eigen::Quaterniond getCorrectionQuaternion(double time, const Eigen::VectorXd &filter_coeff);
-  double convertEstimatedToMeasuredAngularVelocityFrame(double estimate_angular_velocity_frame, std::vector<std::pair<int32_t,double>> &sync_table);
-  Eigen::Quaterniond getCorrectionQuaternionFromFrame(double estimated_angular_velocity_frame, const Eigen::VectorXd &filter_coeff, std::vector<std::pair<int32_t,double>> &sync_table);
+  double convertEstimatedToMeasuredAngularVelocityFrame(double estimate_angular_velocity_frame, const SyncTable &sync_table);
+  Eigen::Quaterniond getCorrectionQuaternionFromFrame(double estimated_angular_velocity_frame, const Eigen::VectorXd &filter_coeff, const SyncTable &sync_table);
+  Eigen::Quaterniond getCorrectionQuaternionFromFrame(double estimated_angular_velocity_frame, Filter &filter, int32_t filter_strength, const SyncTable &sync_table);
+  double getRecursiveFilterDeviation(Filter &filter, int32_t filter_strength, size_t samples = 64);
   double getLengthInSecond();
   int32_t getFrames();
 private:
   // ResamplerParameter resampler_;
-  std::map<int, Eigen::MatrixXd> relative_angle_vectors;
-  const Eigen::MatrixXd &getRelativeAngle(size_t frame, int length);
+  Eigen::MatrixX4d increments; // Rotation of every frame as quaternion coefficients, converted at once from data.
+  std::mutex increment_mutex;
+  const Eigen::MatrixX4d &getIncrements();
+  /**
+   * @brief Relative angles of recent windows. A slot per frame, modulo the number of slots.
+   * @details Each column holds a length x 3 matrix of a slot contiguously, so that the memory stays fixed
+   * regardless of the length of the clip.
+   **/
+  Eigen::MatrixXd relative_angle_cache;
+  std::vector<std::pair<size_t, int>> relative_angle_tags; // Frame and length held by each slot.
+  std::mutex relative_angle_mutex; // Rotation generator calls from several threads.
+  void getRelativeAngle(size_t frame, int length, Eigen::MatrixXd &rotation_vector);
+  /**
+   * @brief Filtered angles calculated by chunks on demand, within a memory budget shared by all filters.
+   * @details Chunks of FIR taps are keyed by the length, chunks of recursive filters by the filter and the strength.
+   * Only chunks which were requested are allocated, and the least recently used chunks are dropped beyond the budget,
+   * since searches of the filter strength touch hundreds of strengths.
+   **/
+  using FilteredKey = std::tuple<const Filter *, int32_t, size_t>; // Recursive filter or nullptr for taps, length or strength, chunk.
+  struct FilteredChunk
+  {
+    std::vector<Eigen::Vector3d> angle;
+    std::list<FilteredKey>::iterator order;
+  };
+  std::map<FilteredKey, FilteredChunk> filtered_chunks;
+  std::list<FilteredKey> filtered_chunk_order; // Most recently used first.
+  size_t filtered_chunk_bytes = 0;
+  std::map<int, std::pair<const double *, Eigen::VectorXd>> filter_taps; // Data and values of the taps of each length.
+  std::mutex filtered_angle_mutex;
+  const std::vector<Eigen::Vector3d> *findFilteredChunk(const FilteredKey &key);
+  void addFilteredChunk(const FilteredKey &key, std::vector<Eigen::Vector3d> &angle);
+  void eraseFilteredChunks(const FilteredKey &first, const FilteredKey &last);
+  void checkFilterTaps(const Eigen::VectorXd &filter_coeff);
+  Eigen::Vector3d getFilteredAngle(size_t frame, const Eigen::VectorXd &filter_coeff);
+  std::vector<Eigen::Vector3d> trajectory; // Integrated angular velocity, which recursive filters smooth.
+  std::mutex trajectory_mutex;
+  const std::vector<Eigen::Vector3d> &getTrajectory();
+  Eigen::Vector3d getFilteredAngle(size_t frame, Filter &filter, int32_t filter_strength);
 };
 
 using AngularVelocityPtr = std::shared_ptr<AngularVelocity>;
@@ -111,14 +177,26 @@ class RotationQuaternion
 {
 public:
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
-  RotationQuaternion(AngularVelocityPtr angular_velocity, ResamplerParameter &resampler);
+  /**
+   * @brief Integrator of angular velocities into orientations.
+   * @details Euler rotates by each sample over its frame. Magnus fits a parabola to a sample and
+   * its neighbours and adds the commutator term, which is 4th order accurate on smooth motion.
+   * Both treat a sample as the angular velocity at the middle of its frame.
+   **/
+  enum class Integrator
+  {
+    Euler,
+    Magnus
+  };
+  RotationQuaternion(AngularVelocityPtr angular_velocity, ResamplerParameter &resampler, Integrator integrator = Integrator::Euler);
   Eigen::Quaterniond getRotationQuaternion(double time);
 
 
 private:
   AngularVelocityPtr angular_velocity_;
   ResamplerParameter resampler_;
-  std::map<int, Eigen::Quaterniond> angle_;
+  QuaternionData angle_; // Orientation at every measured angular velocity frame, integrated once in the constructor.
+  Eigen::Quaterniond getIncrement(int32_t frame, Integrator integrator);
 
 };
 
@@ -154,6 +232,11 @@ public:
   virtual const Eigen::VectorXd &getFilterCoefficient(int32_t alpha) = 0;
   virtual ~Filter(){};
   virtual Filter &operator()(int filter_coefficient) = 0;
+  /**
+   * @brief True if coefficients of the strength are of a recursive filter run forward and backward over the trajectory,
+   * false if they are taps of a FIR filter applied to the window around each frame.
+   **/
+  virtual bool isRecursive(int32_t filter_strength) { return false; }
 protected:
   virtual void setFilterCoefficient(int32_t alpha) = 0;
 
@@ -170,11 +253,35 @@ public:
   NormalDistributionFilter &operator()(int32_t half_length) override;
 protected:
   std::map<int32_t, Eigen::VectorXd> filter_coefficients_;
+  std::mutex filter_coefficients_mutex_;
   int32_t half_length_;
   void setFilterCoefficient(int32_t half_length) override;
 
 };
 
+/**
+ * @brief Recursive approximation of NormalDistributionFilter.
+ * @details Coefficients are (B, a1, a2, a3) of the third order recursion, whose cost per frame doesn't depend on
+ * the strength, and the boundary matrix of the backward pass. The trajectory is the integrated angular velocity,
+ * so that relative angles in the window are approximated by differences of it. Poles are fitted to the taps of
+ * each half length. Corrections differ from NormalDistributionFilter by about 7% RMS at half length 10, 3% at 30
+ * and 1.3% from 100 to 200 with small motion. With larger motion the differences ignoring that rotations don't
+ * commute add to it, up to about 9% at half length 200 and 0.2 rad/s. Check it by
+ * AngularVelocity::getRecursiveFilterDeviation().
+ **/
+class RecursiveGaussianFilter : public NormalDistributionFilter
+{
+public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  RecursiveGaussianFilter();
+  virtual ~RecursiveGaussianFilter(){};
+  RecursiveGaussianFilter &operator()(int32_t half_length) override;
+  bool isRecursive(int32_t half_length) override { return true; }
+protected:
+  void setFilterCoefficient(int32_t half_length) override;
+
+};
+
 using VideoPtr = std::shared_ptr<Video>;
 
 class VideoRateRotation : Rotation
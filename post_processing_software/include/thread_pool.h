@@ -0,0 +1,116 @@
+/*************************************************************************
+*  Software License Agreement (BSD 3-Clause License)
+*  
+*  Copyright (c) 2019, Yoshiaki Sato
+*  All rights reserved.
+*  
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions are met:
+*  
+*  1. Redistributions of source code must retain the above copyright notice, this
+*     list of conditions and the following disclaimer.
+*  
+*  2. Redistributions in binary form must reproduce the above copyright notice,
+*     this list of conditions and the following disclaimer in the documentation
+*     and/or other materials provided with the distribution.
+*  
+*  3. Neither the name of the copyright holder nor the names of its
+*     contributors may be used to endorse or promote products derived from
+*     this software without specific prior written permission.
+*  
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+*  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+*  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+*  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+*  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+*  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+*  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*************************************************************************/
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
+#include <deque>
+#include <vector>
+#include <functional>
+#include <exception>
+
+/**
+ * @brief Work stealing thread pool shared by all stages.
+ * @details Every worker has its own queues. A worker runs its latest task first, and takes the
+ * oldest task of another worker when its own queues are empty. Tasks of a higher priority run first.
+ * The number of workers is the global concurrency limit, which is set by setConcurrency()
+ * before the first getInstance(). A thread waiting in parallelFor() runs chunks of it as well.
+ **/
+class ThreadPool
+{
+public:
+  enum class Priority
+  {
+    High,   // Rendering is waiting for the result.
+    Normal, // Analysis before rendering.
+    Low     // Results needed later.
+  };
+
+  /**
+   * @brief Tasks which are waited for together.
+   * @details submit() blocks while max_in_flight tasks of the group are queued or running,
+   * so that it should be called out of the pool. 0 allows twice the number of workers.
+   * An exception thrown by a task is thrown again by wait().
+   **/
+  class TaskGroup
+  {
+  public:
+    TaskGroup(Priority priority = Priority::Normal, size_t max_in_flight = 0);
+    ~TaskGroup();
+    void submit(std::function<void()> task);
+    void wait();
+
+  private:
+    struct State
+    {
+      std::mutex mutex;
+      std::condition_variable done;
+      size_t in_flight = 0;
+      std::exception_ptr exception;
+    };
+    Priority priority_;
+    size_t max_in_flight_;
+    std::shared_ptr<State> state_;
+  };
+
+  static void setConcurrency(size_t threads);
+  static ThreadPool &getInstance();
+  ~ThreadPool();
+  size_t getConcurrency() const;
+  void submit(std::function<void()> task, Priority priority = Priority::Normal);
+  void parallelFor(int32_t begin, int32_t end, const std::function<void(int32_t, int32_t)> &body,
+                   Priority priority = Priority::Normal, int32_t grain = 0);
+
+private:
+  explicit ThreadPool(size_t threads);
+  struct Queue
+  {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks[3]; // A queue per priority.
+  };
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> workers_;
+  std::atomic<size_t> pending_;    // Tasks in all queues.
+  std::atomic<size_t> next_queue_; // Queue of the next task submitted out of the pool.
+  std::mutex sleep_mutex_;
+  std::condition_variable wake_;
+  bool is_running_;
+  static size_t concurrency_;
+  bool tryRun(int32_t self);
+  void process(int32_t index);
+};
+
+#endif //__THREAD_POOL_H__
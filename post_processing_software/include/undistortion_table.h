@@ -0,0 +1,59 @@
+/*************************************************************************
+*  Software License Agreement (BSD 3-Clause License)
+*  
+*  Copyright (c) 2019, Yoshiaki Sato
+*  All rights reserved.
+*  
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions are met:
+*  
+*  1. Redistributions of source code must retain the above copyright notice, this
+*     list of conditions and the following disclaimer.
+*  
+*  2. Redistributions in binary form must reproduce the above copyright notice,
+*     this list of conditions and the following disclaimer in the documentation
+*     and/or other materials provided with the distribution.
+*  
+*  3. Neither the name of the copyright holder nor the names of its
+*     contributors may be used to endorse or promote products derived from
+*     this software without specific prior written permission.
+*  
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+*  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+*  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+*  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+*  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+*  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+*  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*************************************************************************/
+#ifndef UNDISTORTION_TABLE_H
+#define UNDISTORTION_TABLE_H
+
+#include <Eigen/Dense>
+#include <opencv2/opencv.hpp>
+#include "camera_information.h"
+
+/**
+ * @brief Undistorted normalized coordinates of pixels, sampled every step pixels.
+ * @details The inverse distortion polynomial doesn't depend on frames. It's evaluated once per camera
+ * by calcInverseDistortCoeff(), then looked up with bilinear interpolation by the forward kernel and
+ * getUndistortUnrollingContour().
+ **/
+class UndistortionTable
+{
+public:
+  UndistortionTable(const CameraInformation &camera_info, int step = 4);
+  Eigen::Array2d undistort(const Eigen::Array2d &p) const;
+  const cv::Mat &getTable() const;
+  int getStep() const;
+  static Eigen::Array2d undistortPoint(const CameraInformation &camera_info, const Eigen::Array2d &p);
+
+private:
+  int step_;
+  cv::Mat table_; // CV_32FC2, x and y of the pixel (j*step, i*step).
+};
+
+#endif // UNDISTORTION_TABLE_H
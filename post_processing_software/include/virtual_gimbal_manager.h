@@ -45,7 +45,38 @@
 #include "SO3Filters.h"
 #include "cl_manager.h"
 #include "multi_thread_video_writer.h"
+#include "cpu_stabilizer.h"
+#include "thread_pool.h"
 #include <chrono>         // std::chrono::seconds
+#include <functional>
+
+enum class RenderBackend
+{
+  Auto,   // OpenCL on GPU if available, otherwise CPU.
+  OpenCL,
+  CPU
+};
+
+enum class WarpMode
+{
+  Forward, // Splat each source pixel to output, stabilizer_function.
+  Inverse, // Gather each output pixel from source, stabilizer_function_inverse.
+  Mesh     // Gather with source positions interpolated on a coarse grid, stabilizer_function_mesh.
+};
+
+enum class FilterStrengthSolver
+{
+  Bisection, // Bisection from the whole range on every frame.
+  WarmStart, // Search around the boundary of the previous frame, findFilterStrength().
+  Path       // Search only frames which limit the path under the maximum gradient, findFilterStrengthPath().
+};
+
+enum class FrameFormat
+{
+  BGRA, // Converted from and to BGR by the reader and the writer, for image2d_t kernels.
+  BGR   // Packed layout of cv::VideoCapture and cv::VideoWriter, for *_bgr kernels and CPU.
+};
+
 class VirtualGimbalManager
 {
 public:
@@ -79,13 +110,24 @@ public:
                                    std::vector<double> &residuals, bool fisheye = false);
   Eigen::VectorXd getFilterCoefficients(double zoom,
                                       FilterPtr filter,
-                                      std::vector<std::pair<int32_t,double>> &sync_table, 
+                                      const SyncTable &sync_table, 
                                       int32_t strongest_filter_param, int32_t weakest_filter_param);
-  void spin(double zoom, FilterPtr filter,Eigen::VectorXd &filter_strength, std::vector<std::pair<int32_t,double>> &sync_table, bool show_image = true);
+  Eigen::VectorXd getMinimumZoom(FilterPtr filter, const SyncTable &sync_table, int32_t filter_strength);
+  double getRecursiveFilterDeviation(FilterPtr filter, int32_t filter_strength);
+  void spin(double zoom, FilterPtr filter,Eigen::VectorXd &filter_strength, const SyncTable &sync_table, bool show_image = true);
   void setMaximumGradient(double value);
   void enableWriter(const char *video_path);
   const char *kernel_name = "stabilizer_kernel.cl";
   const char *kernel_function = "stabilizer_function";
+  RenderBackend render_backend = RenderBackend::Auto;
+  WarpMode warp_mode = WarpMode::Forward;
+  int32_t mesh_grid_size = 16; // Cell size of WarpMode::Mesh in pixel.
+  size_t async_frames = 1;      // Frames in flight on OpenCL device. 1 waits for every kernel.
+  FrameFormat frame_format = FrameFormat::BGRA;
+  int32_t tile_size = 0;        // Tile size of tiled rendering in pixel. 0 tiles only frames over the device limit.
+  double keyframe_tolerance = 0.0; // Error of rotations interpolated between keyframe rows in pixel. 0 calculates every row.
+  FilterStrengthSolver filter_strength_solver = FilterStrengthSolver::Bisection;
+  RotationQuaternion::Integrator rotation_integrator = RotationQuaternion::Integrator::Euler; // Integrator of getRotationQuaternions() and the chess board points.
   std::shared_ptr<cv::VideoCapture> getVideoCapture();
   std::shared_ptr<ResamplerParameter> getResamplerParameterWithClockError(Eigen::VectorXd &correlation_begin, Eigen::VectorXd &correlation_end);
   std::vector<std::pair<int32_t,double>> getSyncTable(double period_in_second,int32_t width);
@@ -93,6 +135,8 @@ public:
 protected:
   std::shared_ptr<MultiThreadVideoWriter> writer_;
   std::shared_ptr<MultiThreadVideoReader> reader_;
+  UMatPoolPtr frame_pool_; // Frame buffers shared by reader_, spin() and writer_.
+  UMatPoolPtr getFramePool();
   
 
   RotationPtr rotation;
@@ -143,10 +143,11 @@ void getUndistortUnrollingContour(
     int frame,
     AngularVelocityPtr angular_velocity,
     std::vector<Eigen::Array2d, Eigen::aligned_allocator<Eigen::Array2d>> &contour,
-    std::vector<std::pair<int32_t,double>> sync_table,
+    const SyncTable &sync_table,
     double zoom,
     VideoPtr video_param,
-    const Eigen::VectorXd &filter_coeffs)
+    FilterPtr filter,
+    int32_t filter_strength)
 {
 
     // std::cout << "fc:" << filter_coeffs << std::endl;
@@ -159,14 +160,12 @@ void getUndistortUnrollingContour(
     Eigen::Array2d f, c;
     f << video_param->camera_info->fx_, video_param->camera_info->fy_;
     c << video_param->camera_info->cx_, video_param->camera_info->cy_;
-    const double &ik1 = video_param->camera_info->inverse_k1_;
-    const double &ik2 = video_param->camera_info->inverse_k2_;
-    const double &ip1 = video_param->camera_info->inverse_p1_;
-    const double &ip2 = video_param->camera_info->inverse_p2_;
+    const std::shared_ptr<UndistortionTable> &undistortion_table = video_param->camera_info->undistortion_table_;
 
     contour.clear();
     std::vector<Eigen::Array2d, Eigen::aligned_allocator<Eigen::Array2d>> src_contour = getSparseContour(video_param, 9);
-    Eigen::MatrixXd R;
+    contour.reserve(src_contour.size());
+    Eigen::Matrix3d R;
     Eigen::Array2d x1;
     Eigen::Vector3d x3, xyz;
     for (auto &p : src_contour)
@@ -175,14 +174,11 @@ void getUndistortUnrollingContour(
         double frame_in_row = frame + (line_delay * (p[1] - video_param->camera_info->height_ * 0.5))
             * video_param->getFrequency();
 
-        R = angular_velocity->getCorrectionQuaternionFromFrame(frame_in_row, filter_coeffs,sync_table).matrix();
+        R = angular_velocity->getCorrectionQuaternionFromFrame(frame_in_row, *filter, filter_strength, sync_table).matrix();
         // std::cout << "R:\r\n" << R << std::endl;
         //↑
         x1 = (p - c) / f;
-        double r = x1.matrix().norm();
-        Eigen::Array2d x2 = x1 * (1.0 + ik1 * pow(r, 2.0) + ik2 * pow(r, 4.0));
-        x2[0] += 2.0 * ip1 * x1[0] * x1[1] + ip2 * (pow(r, 2.0) + 2 * pow(x1[0], 2.0));
-        x2[1] += ip1 * (pow(r, 2.0) + 2.0 * pow(x1[1], 2.0)) + 2.0 * ip2 * x1[0] * x1[1];
+        Eigen::Array2d x2 = undistortion_table ? undistortion_table->undistort(p) : UndistortionTable::undistortPoint(*video_param->camera_info, p);
         //折り返し防止
         if (((x2 - x1).abs() > 1).any())
         {
@@ -200,16 +196,97 @@ void getUndistortUnrollingContour(
     // }
 }
 
+BlackSpaceEvaluator::BlackSpaceEvaluator(AngularVelocityPtr angular_velocity,
+                                         VideoPtr video_param,
+                                         FilterPtr filter,
+                                         const SyncTable &sync_table,
+                                         double zoom)
+    : evaluations(0), angular_velocity_(angular_velocity), filter_(filter), sync_table_(sync_table), zoom_(zoom)
+{
+    const CameraInformation &camera_info = *video_param->camera_info;
+    f_ << camera_info.fx_, camera_info.fy_;
+    c_ << camera_info.cx_, camera_info.cy_;
+    border_ << camera_info.width_ - 1., camera_info.height_ - 1.;
+    const std::shared_ptr<UndistortionTable> &undistortion_table = camera_info.undistortion_table_;
+
+    std::vector<Eigen::Array2d, Eigen::aligned_allocator<Eigen::Array2d>> contour = getSparseContour(video_param, 9);
+    // Points on a row share the rotation, it is calculated once per row.
+    std::stable_sort(contour.begin(), contour.end(), [](const Eigen::Array2d &l, const Eigen::Array2d &r) { return l[1] < r[1]; });
+    rays_.resize(3, contour.size());
+    rotated_rays_.resize(3, contour.size());
+    u_.resize(contour.size());
+    v_.resize(contour.size());
+    for (size_t i = 0; i < contour.size(); ++i)
+    {
+        const Eigen::Array2d &p = contour[i];
+        if ((0 == i) || (contour[i - 1][1] != p[1]))
+        {
+            row_begin_.push_back(i);
+            row_delay_.push_back((camera_info.line_delay_ * (p[1] - camera_info.height_ * 0.5)) * video_param->getFrequency());
+        }
+        Eigen::Array2d x1 = (p - c_) / f_;
+        Eigen::Array2d x2 = undistortion_table ? undistortion_table->undistort(p) : UndistortionTable::undistortPoint(camera_info, p);
+        //折り返し防止
+        if (((x2 - x1).abs() > 1).any())
+        {
+            printf("Warning: Turn backing.\n");
+            x2 = x1;
+        }
+        rays_.col(i) << x2[0], x2[1], 1.0;
+    }
+    row_begin_.push_back(contour.size());
+}
+
+void BlackSpaceEvaluator::rotate(int frame, int32_t filter_strength)
+{
+    for (size_t row = 0; row + 1 < row_begin_.size(); ++row)
+    {
+        const Eigen::Matrix3d R = angular_velocity_->getCorrectionQuaternionFromFrame(frame + row_delay_[row], *filter_, filter_strength, sync_table_).matrix();
+        const int32_t begin = row_begin_[row];
+        const int32_t columns = row_begin_[row + 1] - begin;
+        rotated_rays_.middleCols(begin, columns).noalias() = R.lazyProduct(rays_.middleCols(begin, columns));
+    }
+}
+
+bool BlackSpaceEvaluator::hasBlackSpace(int frame, int32_t filter_strength)
+{
+    ++evaluations;
+    rotate(frame, filter_strength);
+    // Projects all points and looks for one inside the frame, which means the border of the frame is visible.
+    u_ = rotated_rays_.row(0).array() / rotated_rays_.row(2).array() * f_[0] * zoom_ + c_[0];
+    v_ = rotated_rays_.row(1).array() / rotated_rays_.row(2).array() * f_[1] * zoom_ + c_[1];
+    return ((u_ > 0.) && (u_ < border_[0]) && (v_ > 0.) && (v_ < border_[1])).any();
+}
+
+/**
+ * @brief Smallest zoom without black space of a frame with a filter strength. The zoom given at construction is ignored.
+ * @details A projected point moves away from the principal point in proportion to the zoom, so that it leaves the frame
+ * from a zoom on, which is solved for each point. The largest one of all points is the answer.
+ **/
+double BlackSpaceEvaluator::getMinimumZoom(int frame, int32_t filter_strength)
+{
+    ++evaluations;
+    rotate(frame, filter_strength);
+    // Offsets from the principal point at zoom 1.
+    u_ = rotated_rays_.row(0).array() / rotated_rays_.row(2).array() * f_[0];
+    v_ = rotated_rays_.row(1).array() / rotated_rays_.row(2).array() * f_[1];
+    // Zoom at which each point reaches the edge it is heading for. A point on the principal point never leaves.
+    const double infinity = std::numeric_limits<double>::infinity();
+    u_ = (u_ > 0.).select((border_[0] - c_[0]) / u_, (u_ < 0.).select(-c_[0] / u_, infinity));
+    v_ = (v_ > 0.).select((border_[1] - c_[1]) / v_, (v_ < 0.).select(-c_[1] / v_, infinity));
+    return u_.min(v_).maxCoeff();
+}
+
 bool hasBlackSpace(int frame,
                    double zoom,
                    AngularVelocityPtr angular_velocity,
                    VideoPtr video_param,
-                   Eigen::VectorXd filter_coefficients,
-                   std::vector<std::pair<int32_t,double>> &sync_table)
+                   FilterPtr filter,
+                   int32_t filter_strength,
+                   const SyncTable &sync_table)
 {
-    std::vector<Eigen::Array2d, Eigen::aligned_allocator<Eigen::Array2d>> contour;
-    getUndistortUnrollingContour(frame, angular_velocity, contour, sync_table, zoom, video_param, filter_coefficients);
-    return !isGoodWarp(contour,video_param);
+    BlackSpaceEvaluator evaluator(angular_velocity, video_param, filter, sync_table, zoom);
+    return evaluator.hasBlackSpace(frame, filter_strength);
 }
 
 uint32_t bisectionMethod(int frame,
@@ -217,7 +294,17 @@ uint32_t bisectionMethod(int frame,
                          AngularVelocityPtr angular_velocity,
                          VideoPtr video_param,
                          FilterPtr filter,
-                         std::vector<std::pair<int32_t,double>> &sync_table,
+                         const SyncTable &sync_table,
+                         int32_t minimum_filter_strength,
+                         int32_t maximum_filter_strength,
+                         int max_iteration, uint32_t eps)
+{
+    BlackSpaceEvaluator evaluator(angular_velocity, video_param, filter, sync_table, zoom);
+    return bisectionMethod(frame, evaluator, minimum_filter_strength, maximum_filter_strength, max_iteration, eps);
+}
+
+uint32_t bisectionMethod(int frame,
+                         BlackSpaceEvaluator &evaluator,
                          int32_t minimum_filter_strength,
                          int32_t maximum_filter_strength,
                          int max_iteration, uint32_t eps)
@@ -226,11 +313,13 @@ uint32_t bisectionMethod(int frame,
     int32_t b = minimum_filter_strength;
     int count = 0;
     int32_t m = 0;
+    // a moves only to a strength with the same result, so that the result of a is evaluated once.
+    const bool black_a = evaluator.hasBlackSpace(frame, a);
     while (((uint32_t)abs(a - b) > eps) && (count++ < max_iteration))
     {
         m = (a + b) * 0.5;
 
-        if (hasBlackSpace(frame, zoom, angular_velocity, video_param, filter->getFilterCoefficient(a),sync_table) ^ hasBlackSpace(frame, zoom, angular_velocity, video_param, filter->getFilterCoefficient(m),sync_table))
+        if (black_a ^ evaluator.hasBlackSpace(frame, m))
         {
             b = m;
         }
@@ -246,3 +335,222 @@ uint32_t bisectionMethod(int frame,
     return m;
 }
 
+/**
+ * @brief Filter strength of a frame, the same as the weakest and the strongest checks followed by bisectionMethod().
+ * @details Black space is assumed to appear from a boundary strength on. The boundary is searched from the one of
+ * the last frame in search, by steps growing twice until it is bracketed, and the bracket is bisected.
+ * Adjacent frames have close boundaries, so that a few evaluations are enough. The result of bisectionMethod()
+ * is then reproduced by answering its questions from the boundary without evaluation.
+ **/
+uint32_t findFilterStrength(int frame,
+                            BlackSpaceEvaluator &evaluator,
+                            int32_t strongest_filter_strength,
+                            int32_t weakest_filter_strength,
+                            FilterStrengthSearch &search,
+                            int max_iteration, uint32_t eps)
+{
+    // Strengths are counted in steps k from the weakest one, black space appears at larger k.
+    const int32_t direction = (strongest_filter_strength >= weakest_filter_strength) ? 1 : -1;
+    const int32_t steps = abs(strongest_filter_strength - weakest_filter_strength);
+    // good is the largest k known without black space, bad is the smallest k known with black space.
+    // -1 and steps + 1 are out of the range, so that the weakest and the strongest are evaluated before they are returned.
+    int32_t good = -1;
+    int32_t bad = steps + 1;
+    auto test = [&](int32_t k) {
+        bool black = evaluator.hasBlackSpace(frame, weakest_filter_strength + direction * k);
+        if (black)
+        {
+            bad = std::min(bad, k);
+        }
+        else
+        {
+            good = std::max(good, k);
+        }
+        return black;
+    };
+
+    if (search.boundary >= 0)
+    {
+        int32_t k = std::min(search.boundary, steps);
+        if (!test(k))
+        {
+            for (int32_t step = 1; bad - good > 1; step *= 2)
+            {
+                if (test(std::min(good + step, bad - 1)))
+                {
+                    break;
+                }
+            }
+        }
+        else
+        {
+            for (int32_t step = 1; bad - good > 1; step *= 2)
+            {
+                if (!test(std::max(bad - step, good + 1)))
+                {
+                    break;
+                }
+            }
+        }
+    }
+    while (bad - good > 1)
+    {
+        test((good + bad) / 2);
+    }
+    search.boundary = std::max(good, 0);
+
+    if (good < 0)
+    {
+        return weakest_filter_strength;
+    }
+    if (good >= steps)
+    {
+        return strongest_filter_strength;
+    }
+
+    // Same steps as bisectionMethod(frame, ..., strongest_filter_strength, weakest_filter_strength).
+    auto hasBlack = [&](int32_t strength) { return (strength - weakest_filter_strength) * direction > good; };
+    int32_t a = weakest_filter_strength;
+    int32_t b = strongest_filter_strength;
+    int count = 0;
+    int32_t m = 0;
+    while (((uint32_t)abs(a - b) > eps) && (count++ < max_iteration))
+    {
+        m = (a + b) * 0.5;
+        if (hasBlack(a) ^ hasBlack(m))
+        {
+            b = m;
+        }
+        else
+        {
+            a = m;
+        }
+        if (count == max_iteration)
+        {
+            std::cout << "max_iteration" << std::endl;
+        }
+    }
+    return m;
+}
+
+/**
+ * @brief Strongest path of the filter strength over all frames without black space, under the maximum gradient.
+ * @details Frames are swept forward once. The path at a frame can't exceed the one of the previous frame plus maximum_gradient.
+ * If the frame has no black space at this bound, its boundary never limits the path and the bound is written with an evaluation.
+ * Otherwise the boundary is searched downward from the bound by steps growing twice, and bisected.
+ * Only frames where the path has to come down are searched. Black space is assumed to appear from a boundary strength on.
+ * Evaluations run in parallel, one per evaluator: the bounds of the following frames are tested together assuming
+ * none of them comes down, and a search tests several steps or splits the bracket into several parts at once.
+ * The result doesn't depend on the number of evaluators. The sweep bounds the path only by earlier frames, so that
+ * it is finally swept backward to bound it by later frames too, as the backward half of gradientLimit().
+ * @param progress Called with the number of frames swept so far.
+ **/
+void findFilterStrengthPath(std::vector<BlackSpaceEvaluator, Eigen::aligned_allocator<BlackSpaceEvaluator>> &evaluators,
+                            int32_t strongest_filter_strength,
+                            int32_t weakest_filter_strength,
+                            double maximum_gradient,
+                            Eigen::VectorXd &filter_strength,
+                            const std::function<void(int32_t)> &progress)
+{
+    // Strengths are counted in steps k from the weakest one, black space appears at larger k.
+    const int32_t direction = (strongest_filter_strength >= weakest_filter_strength) ? 1 : -1;
+    const int32_t steps = abs(strongest_filter_strength - weakest_filter_strength);
+    const int32_t frames = filter_strength.rows();
+    const int32_t lanes = evaluators.size();
+    std::vector<int32_t> frame_of(lanes), k_of(lanes);
+    std::vector<char> black(lanes);
+    // Evaluates (frame_of[i], k_of[i]) of the first count lanes to black[i].
+    auto evaluate = [&](int32_t count) {
+        ThreadPool::getInstance().parallelFor(0, count, [&](int32_t begin, int32_t end) {
+            for (int32_t i = begin; i < end; ++i)
+            {
+                black[i] = evaluators[i].hasBlackSpace(frame_of[i], weakest_filter_strength + direction * k_of[i]);
+            }
+        }, ThreadPool::Priority::Normal, 1);
+    };
+
+    std::vector<double> path(frames);
+    double bound = steps;
+    for (int32_t frame = 0; frame < frames;)
+    {
+        const int32_t count = std::min(lanes, frames - frame);
+        std::vector<double> bounds(count);
+        for (int32_t i = 0; i < count; ++i)
+        {
+            bounds[i] = bound;
+            frame_of[i] = frame + i;
+            k_of[i] = std::min((int32_t)ceil(bound), steps);
+            bound = std::min(bound + maximum_gradient, (double)steps);
+        }
+        evaluate(count);
+        int32_t i = 0;
+        for (; (i < count) && !black[i]; ++i)
+        {
+            path[frame + i] = bounds[i];
+        }
+        if (i < count)
+        {
+            // good is the largest k known without black space, bad is the smallest k known with black space.
+            const int32_t searched = frame + i;
+            int32_t good = -1;
+            int32_t bad = k_of[i];
+            int32_t step = 1;
+            bool bracketed = false;
+            while (bad - good > 1)
+            {
+                int32_t tests = 0;
+                if (!bracketed)
+                {
+                    // Steps growing twice from bad until one has no black space.
+                    for (; (tests < lanes) && (bad - step > good); step *= 2)
+                    {
+                        k_of[tests++] = bad - step;
+                    }
+                    if ((tests < lanes) && ((0 == tests) || (k_of[tests - 1] > good + 1)))
+                    {
+                        k_of[tests++] = good + 1;
+                    }
+                }
+                else
+                {
+                    // Bisection of the bracket into up to lanes + 1 parts.
+                    tests = std::min(lanes, bad - good - 1);
+                    for (int32_t t = 0; t < tests; ++t)
+                    {
+                        k_of[t] = good + (int32_t)((int64_t)(bad - good) * (t + 1) / (tests + 1));
+                    }
+                }
+                std::fill(frame_of.begin(), frame_of.begin() + tests, searched);
+                evaluate(tests);
+                for (int32_t t = 0; t < tests; ++t)
+                {
+                    if (black[t])
+                    {
+                        bad = std::min(bad, k_of[t]);
+                    }
+                    else
+                    {
+                        good = std::max(good, k_of[t]);
+                        bracketed = true;
+                    }
+                }
+            }
+            // Even the weakest strength has black space, the weakest is used anyway.
+            bound = std::max(good, 0);
+            path[searched] = bound;
+            bound = std::min(bound + maximum_gradient, (double)steps);
+            i += 1;
+        }
+        frame += i;
+        progress(frame);
+    }
+
+    for (int32_t frame = frames - 2; frame >= 0; --frame)
+    {
+        path[frame] = std::min(path[frame], path[frame + 1] + maximum_gradient);
+    }
+    for (int32_t frame = 0; frame < frames; ++frame)
+    {
+        filter_strength[frame] = weakest_filter_strength + direction * path[frame];
+    }
+}
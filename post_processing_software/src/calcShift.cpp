@@ -36,7 +36,57 @@
 #include <cmath>
 #include <Eigen/Dense>
 #include <memory>
+#include "thread_pool.h"
+
+/**
+ * @brief Shift between two grey frames. Rows of the frame in optical_flow and confidence are written.
+ **/
+static void calcShift(const cv::Mat &prev_grey, const cv::Mat &cur_grey, int frame, int total_frames, Eigen::MatrixXd &optical_flow, Eigen::MatrixXd &confidence)
+{
+    // vector from prev to cur
+    std::vector <cv::Point2f> prev_corner, cur_corner;
+    std::vector <cv::Point2f> prev_corner2, cur_corner2;
+    std::vector <uchar> status;
+    std::vector <float> err;
+
+    cv::goodFeaturesToTrack(prev_grey, prev_corner, 200, 0.01, 30);
+    cv::calcOpticalFlowPyrLK(prev_grey, cur_grey, prev_corner, cur_corner, status, err);
+
+    // weed out bad matches
+    for(size_t i=0; i < status.size(); i++) {
+        if(status[i]) {
+            prev_corner2.push_back(prev_corner[i]);
+            cur_corner2.push_back(cur_corner[i]);
+        }
+    }
+
+    // translation + rotation only
+    try{
+        cv::Mat T = cv::estimateAffinePartial2D(prev_corner2, cur_corner2); 
+
+        // in rare cases no transform is found. We'll just use the last known good transform.
+        if(T.data == NULL) {
+            optical_flow.row(frame) << 0.0, 0.0, 0.0;
+            confidence.row(frame) << 0.0;
+        }else{
+            double dx = T.at<double>(0,2);
+            double dy = T.at<double>(1,2);
+            double da = atan2(T.at<double>(1,0), T.at<double>(0,0));
+            optical_flow.row(frame) << dx, dy, da;
+            confidence.row(frame) << 1.0;
+        }
+    }catch(...){
+        optical_flow.row(frame) << 0.0, 0.0, 0.0;
+        confidence.row(frame) << 0.0;
+    }
+
+    printf("Frame: %d/%d - good optical flow: %lu       \r",frame,total_frames,prev_corner2.size());
+}
 
+/**
+ * @brief Shift of every frame from the previous one.
+ * @details Frames are decoded in order on the calling thread. Pairs of frames are analyzed as tasks of the ThreadPool.
+ **/
 void CalcShiftFromVideo(const char *filename, int total_frames, Eigen::MatrixXd &optical_flow, Eigen::MatrixXd &confidence){
     // Open Video
     assert(0 != total_frames);
@@ -47,7 +97,7 @@ void CalcShiftFromVideo(const char *filename, int total_frames, Eigen::MatrixXd
     optical_flow = Eigen::MatrixXd::Zero(total_frames,3);
     confidence = Eigen::MatrixXd::Zero(total_frames,1);
 
-    cv::Mat cur, cur_grey;
+    cv::Mat cur;
     cv::Mat prev, prev_grey;
 
     // Get first frame
@@ -65,11 +115,8 @@ void CalcShiftFromVideo(const char *filename, int total_frames, Eigen::MatrixXd
     }
     
     // Step 1 - Get previous to current frame transformation (dx, dy, da) for all frames
-    std::vector <cv::Vec3d> prev_to_cur_transform; // previous to current
-    // int k=1;
-
-
-    
+    // Tasks hold their grey frames, which are not reused while they run.
+    ThreadPool::TaskGroup tasks;
     for(int frame=0;frame<total_frames;++frame) {
         cap >> cur;
 
@@ -78,6 +125,7 @@ void CalcShiftFromVideo(const char *filename, int total_frames, Eigen::MatrixXd
         }
 
         // Trimming
+        cv::Mat cur_grey;
         if((width >= 640) && (height >= 480))
         {
             cv::cvtColor(cur(cv::Rect((cur.cols-640)/2,(cur.rows-480)/2,640,480)), cur_grey, cv::COLOR_BGR2GRAY);
@@ -86,49 +134,12 @@ void CalcShiftFromVideo(const char *filename, int total_frames, Eigen::MatrixXd
             cv::cvtColor(cur, cur_grey, cv::COLOR_BGR2GRAY);
         }
 
-
-        // vector from prev to cur
-        std::vector <cv::Point2f> prev_corner, cur_corner;
-        std::vector <cv::Point2f> prev_corner2, cur_corner2;
-        std::vector <uchar> status;
-        std::vector <float> err;
-
-        cv::goodFeaturesToTrack(prev_grey, prev_corner, 200, 0.01, 30);
-        cv::calcOpticalFlowPyrLK(prev_grey, cur_grey, prev_corner, cur_corner, status, err);
-
-        // weed out bad matches
-        for(size_t i=0; i < status.size(); i++) {
-            if(status[i]) {
-                prev_corner2.push_back(prev_corner[i]);
-                cur_corner2.push_back(cur_corner[i]);
-            }
-        }
-
-        // translation + rotation only
-        try{
-            cv::Mat T = cv::estimateAffinePartial2D(prev_corner2, cur_corner2); 
-
-            // in rare cases no transform is found. We'll just use the last known good transform.
-            if(T.data == NULL) {
-                optical_flow.row(frame) << 0.0, 0.0, 0.0;
-                confidence.row(frame) << 0.0;
-            }else{
-                double dx = T.at<double>(0,2);
-                double dy = T.at<double>(1,2);
-                double da = atan2(T.at<double>(1,0), T.at<double>(0,0));
-                optical_flow.row(frame) << dx, dy, da;
-                confidence.row(frame) << 1.0;
-            }
-        }catch(...){
-            optical_flow.row(frame) << 0.0, 0.0, 0.0;
-            confidence.row(frame) << 0.0;
-        }
-
-        cur.copyTo(prev);
-        cur_grey.copyTo(prev_grey);
-
-        printf("Frame: %d/%d - good optical flow: %lu       \r",frame,total_frames,prev_corner2.size());
+        tasks.submit([prev_grey, cur_grey, frame, total_frames, &optical_flow, &confidence]() {
+            calcShift(prev_grey, cur_grey, frame, total_frames, optical_flow, confidence);
+        });
+        prev_grey = cur_grey;
     }
+    tasks.wait();
     // return prev_to_cur_transform;
     return;
 }
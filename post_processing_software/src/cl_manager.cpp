@@ -62,26 +62,153 @@ void initializeCL(cv::ocl::Context &context)
     cv::ocl::Device(context.device(0));
 }
 
-void getKernel(const char *kernel_code_file_name, const char *kernel_function, cv::ocl::Kernel &kernel, cv::ocl::Context &context, std::string build_opt)
+/**
+ * @brief 64bit FNV-1a hash of the string.
+ **/
+static uint64_t hashString(const std::string &str)
 {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : str)
+    {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
 
+/**
+ * @brief Directory to store compiled program binaries.
+ * @details VIRTUAL_GIMBAL_CL_CACHE overrides the default, $XDG_CACHE_HOME/virtualGimbal or ~/.cache/virtualGimbal.
+ * Empty string disables the cache on disk.
+ **/
+static std::string getProgramCacheDirectory()
+{
+    const char *dir = getenv("VIRTUAL_GIMBAL_CL_CACHE");
+    if (dir)
+    {
+        return std::string(dir);
+    }
+    if ((dir = getenv("XDG_CACHE_HOME")) && dir[0])
+    {
+        mkdir(dir, 0755);
+        return std::string(dir) + "/virtualGimbal";
+    }
+    if ((dir = getenv("HOME")) && dir[0])
+    {
+        std::string cache = std::string(dir) + "/.cache";
+        mkdir(cache.c_str(), 0755);
+        return cache + "/virtualGimbal";
+    }
+    return std::string();
+}
 
-    std::ifstream ifs(kernel_code_file_name);
+static bool loadProgramBinary(const std::string &path, std::vector<char> &binary)
+{
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs)
+    {
+        return false;
+    }
+    binary.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+    return !binary.empty();
+}
+
+static void saveProgramBinary(const std::string &directory, const std::string &path, const cv::ocl::Program &program)
+{
+    std::vector<char> binary;
+    program.getBinary(binary);
+    if (binary.empty())
+    {
+        return;
+    }
+    mkdir(directory.c_str(), 0755);
+    // Write to a temporary file and rename it, so that other processes never read a partial binary.
+    std::string temporary_path = path + "." + std::to_string(getpid()) + ".tmp";
+    {
+        std::ofstream ofs(temporary_path, std::ios::binary);
+        if (!ofs.write(binary.data(), binary.size()))
+        {
+            std::cerr << "Failed writing the program cache " << temporary_path << std::endl;
+            remove(temporary_path.c_str());
+            return;
+        }
+    }
+    if (rename(temporary_path.c_str(), path.c_str()))
+    {
+        remove(temporary_path.c_str());
+    }
+}
 
-        
+/**
+ * @brief Build the program once per process and once per machine.
+ * @details Programs are cached in memory and their binaries are cached in getProgramCacheDirectory().
+ * Both are keyed by the hash of the kernel source, the build options and the device and its driver,
+ * so that an edited kernel or an updated driver is compiled again.
+ **/
+static cv::ocl::Program getProgram(const char *kernel_code_file_name, cv::ocl::Context &context, const std::string &build_opt)
+{
+    static std::mutex mutex;
+    static std::map<std::string, cv::ocl::Program> programs;
+
+    std::ifstream ifs(kernel_code_file_name);
     std::string kernelSource((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
-    cv::ocl::ProgramSource programSource(kernelSource);
 
-    // Compile the kernel code
+    const cv::ocl::Device &device = context.device(0);
+    std::string key = device.name() + "|" + device.version() + "|" + device.driverVersion() + "|" + build_opt + "|" + kernelSource;
+    char hash[17];
+    snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)hashString(key));
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = programs.find(key);
+    if (programs.end() != it)
+    {
+        return it->second;
+    }
+
     cv::String errmsg;
-    cv::ocl::Program program = context.getProg(programSource, build_opt, errmsg);
+    cv::ocl::Program program;
+    std::string directory = getProgramCacheDirectory();
+    std::string path = directory.empty() ? std::string() : directory + "/" + hash + ".bin";
+    std::vector<char> binary;
+    if (!path.empty() && loadProgramBinary(path, binary))
+    {
+        cv::ocl::ProgramSource binarySource = cv::ocl::ProgramSource::fromBinary("virtualGimbal", hash, (const unsigned char *)binary.data(), binary.size(), build_opt);
+        program = context.getProg(binarySource, build_opt, errmsg);
+        if (NULL == program.ptr())
+        {
+            std::cerr << "Program cache " << path << " is broken, compile again." << std::endl;
+        }
+    }
+
     if (NULL == program.ptr())
     {
-        std::cerr << errmsg << std::endl << std::flush;
-        throw "getProg failed.";
+        // Compile the kernel code
+        cv::ocl::ProgramSource programSource(kernelSource);
+        program = context.getProg(programSource, build_opt, errmsg);
+        if (NULL == program.ptr())
+        {
+            std::cerr << errmsg << std::endl << std::flush;
+            throw "getProg failed.";
+        }
+        if (!path.empty())
+        {
+            saveProgramBinary(directory, path, program);
+        }
     }
 
+    programs[key] = program;
+    return program;
+}
+
+void getKernel(const char *kernel_code_file_name, const char *kernel_function, cv::ocl::Kernel &kernel, cv::ocl::Context &context, std::string build_opt)
+{
+    cv::ocl::Program program = getProgram(kernel_code_file_name, context, build_opt);
     kernel = cv::ocl::Kernel(kernel_function, program);
+    if (kernel.empty())
+    {
+        std::cerr << "Kernel " << kernel_function << " is not found in " << kernel_code_file_name << std::endl << std::flush;
+        throw "Kernel is not found.";
+    }
 }
 
 // void runKernel(cv::UMat &umat_src, cv::UMat &umat_dst,cv::ocl::Kernel &kernel){
@@ -0,0 +1,328 @@
+/*************************************************************************
+*  Software License Agreement (BSD 3-Clause License)
+*  
+*  Copyright (c) 2019, Yoshiaki Sato
+*  All rights reserved.
+*  
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions are met:
+*  
+*  1. Redistributions of source code must retain the above copyright notice, this
+*     list of conditions and the following disclaimer.
+*  
+*  2. Redistributions in binary form must reproduce the above copyright notice,
+*     this list of conditions and the following disclaimer in the documentation
+*     and/or other materials provided with the distribution.
+*  
+*  3. Neither the name of the copyright holder nor the names of its
+*     contributors may be used to endorse or promote products derived from
+*     this software without specific prior written permission.
+*  
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+*  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+*  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+*  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+*  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+*  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+*  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*************************************************************************/
+#include "cpu_stabilizer.h"
+#include <algorithm>
+#include <cassert>
+#include <cfloat>
+#include <cmath>
+
+// Number of fixed point iterations to find the source row, which the rotation matrix depends on.
+#define SOURCE_ROW_ITERATION 3
+
+CpuStabilizer::CpuStabilizer(VideoPtr video_param, double zoom, int grid_size, int tile_rows) : width_(video_param->camera_info->width_),
+                                                                                  height_(video_param->camera_info->height_),
+                                                                                  grid_size_(grid_size),
+                                                                                  tile_rows_(tile_rows),
+                                                                                  fx_(video_param->camera_info->fx_),
+                                                                                  fy_(video_param->camera_info->fy_),
+                                                                                  cx_(video_param->camera_info->cx_),
+                                                                                  cy_(video_param->camera_info->cy_),
+                                                                                  k1_(video_param->camera_info->k1_),
+                                                                                  k2_(video_param->camera_info->k2_),
+                                                                                  p1_(video_param->camera_info->p1_),
+                                                                                  p2_(video_param->camera_info->p2_),
+                                                                                  zoom_(zoom),
+                                                                                  map_x_(height_, width_, CV_32FC1),
+                                                                                  map_y_(height_, width_, CV_32FC1)
+{
+}
+
+/**
+ * @brief Inverse of warp_undistort() in the kernel.
+ * @details The kernel applies the inverse distortion coefficients and then the rotation of the source row.
+ * Here the ray of the output pixel is rotated back with the transposed matrix and distorted with the
+ * original coefficients. Since the matrix depends on the source row, the row is solved by fixed point iteration.
+ * @retval false: The ray never hits the source image plane.
+ **/
+bool CpuStabilizer::getSourcePosition(const float *rotation_matrix, float u, float v, float &src_u, float &src_v) const
+{
+    const float x = (u - cx_) / (fx_ * zoom_);
+    const float y = (v - cy_) / (fy_ * zoom_);
+    float row = v;
+    for (int i = 0; i < SOURCE_ROW_ITERATION; ++i)
+    {
+        int r = std::min(std::max((int)(row + 0.5f), 0), height_ - 1);
+        const float *R = rotation_matrix + 9 * r;
+        float X = R[0] * x + R[3] * y + R[6];
+        float Y = R[1] * x + R[4] * y + R[7];
+        float Z = R[2] * x + R[5] * y + R[8];
+        if (Z <= 0.f)
+        {
+            return false;
+        }
+        float x2 = X / Z;
+        float y2 = Y / Z;
+        float r2 = x2 * x2 + y2 * y2;
+        float radial = 1.f + k1_ * r2 + k2_ * r2 * r2;
+        float x1 = x2 * radial + 2.f * p1_ * x2 * y2 + p2_ * (r2 + 2.f * x2 * x2);
+        float y1 = y2 * radial + p1_ * (r2 + 2.f * y2 * y2) + 2.f * p2_ * x2 * y2;
+        src_u = x1 * fx_ + cx_;
+        src_v = y1 * fy_ + cy_;
+        row = src_v;
+    }
+    return true;
+}
+
+void CpuStabilizer::generateMap(const std::vector<float> &rotation_matrix, int row_begin, int row_end)
+{
+    for (int v = row_begin; v < row_end; ++v)
+    {
+        float *map_x = map_x_.ptr<float>(v);
+        float *map_y = map_y_.ptr<float>(v);
+        for (int u = 0; u < width_; ++u)
+        {
+            if (!getSourcePosition(rotation_matrix.data(), (float)u, (float)v, map_x[u], map_y[u]))
+            {
+                // Out of the source image, it is filled with the border value.
+                map_x[u] = -1.f;
+                map_y[u] = -1.f;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Grow the box by the margin and clip it by the frame. Empty if no point was added.
+ **/
+static cv::Rect toSourceRect(float min_u, float min_v, float max_u, float max_v, int margin, int width, int height)
+{
+    if (min_u > max_u)
+    {
+        return cv::Rect();
+    }
+    cv::Point top_left((int)std::floor(min_u) - margin, (int)std::floor(min_v) - margin);
+    cv::Point bottom_right((int)std::ceil(max_u) + margin + 1, (int)std::ceil(max_v) + margin + 1);
+    return cv::Rect(top_left, bottom_right) & cv::Rect(0, 0, width, height);
+}
+
+/**
+ * @brief Region of the source frame which covers the source positions of dst_rect.
+ * @details Source positions are sampled on the border of dst_rect, since the warp is smooth and one to one,
+ * so that the border of the rectangle is mapped to the border of its source region.
+ * @param [in] margin Pixels added around the region for bilinear sampling and the error of the fixed point iteration.
+ * @retval Empty if no pixel of dst_rect has a source position in the frame.
+ **/
+cv::Rect CpuStabilizer::getSourceRect(const std::vector<float> &rotation_matrix, const cv::Rect &dst_rect, int margin) const
+{
+    const int step = 8;
+    float min_u = FLT_MAX, min_v = FLT_MAX, max_u = -FLT_MAX, max_v = -FLT_MAX;
+    auto addPoint = [&](int u, int v) {
+        float src_u, src_v;
+        if (getSourcePosition(rotation_matrix.data(), (float)u, (float)v, src_u, src_v))
+        {
+            min_u = std::min(min_u, src_u);
+            min_v = std::min(min_v, src_v);
+            max_u = std::max(max_u, src_u);
+            max_v = std::max(max_v, src_v);
+        }
+    };
+    int right = dst_rect.br().x - 1;
+    int bottom = dst_rect.br().y - 1;
+    for (int u = dst_rect.x; u < right; u += step)
+    {
+        addPoint(u, dst_rect.y);
+        addPoint(u, bottom);
+    }
+    for (int v = dst_rect.y; v < bottom; v += step)
+    {
+        addPoint(dst_rect.x, v);
+        addPoint(right, v);
+    }
+    addPoint(right, bottom);
+    return toSourceRect(min_u, min_v, max_u, max_v, margin, width_, height_);
+}
+
+/**
+ * @brief Region of the source frame which covers the source positions of dst_rect interpolated from the mesh.
+ * @details Interpolated positions are inside the box of the vertices of the cells which dst_rect overlaps.
+ **/
+cv::Rect CpuStabilizer::getSourceRect(const cv::Mat &mesh, const cv::Rect &dst_rect, int margin) const
+{
+    float min_u = FLT_MAX, min_v = FLT_MAX, max_u = -FLT_MAX, max_v = -FLT_MAX;
+    for (int i = dst_rect.y / grid_size_, e = (dst_rect.br().y - 1) / grid_size_ + 1; i <= e; ++i)
+    {
+        const cv::Vec2f *vertex = mesh.ptr<cv::Vec2f>(i);
+        for (int j = dst_rect.x / grid_size_, ej = (dst_rect.br().x - 1) / grid_size_ + 1; j <= ej; ++j)
+        {
+            if (vertex[j][0] < -1e5f)
+            {
+                // No source position
+                continue;
+            }
+            min_u = std::min(min_u, vertex[j][0]);
+            min_v = std::min(min_v, vertex[j][1]);
+            max_u = std::max(max_u, vertex[j][0]);
+            max_v = std::max(max_v, vertex[j][1]);
+        }
+    }
+    return toSourceRect(min_u, min_v, max_u, max_v, margin, width_, height_);
+}
+
+int CpuStabilizer::getGridSize() const
+{
+    return grid_size_;
+}
+
+/**
+ * @brief Number of vertices of the mesh. The last vertices are out of the image if the size is not a multiple of the grid.
+ **/
+cv::Size CpuStabilizer::getMeshSize() const
+{
+    assert(grid_size_ > 0);
+    return cv::Size((width_ - 1) / grid_size_ + 2, (height_ - 1) / grid_size_ + 2);
+}
+
+/**
+ * @brief Evaluate the exact source position on every vertex of the mesh.
+ * @param [out] mesh CV_32FC2 source positions. A vertex which has no source position is set far outside of the image.
+ **/
+void CpuStabilizer::generateMesh(const std::vector<float> &rotation_matrix, cv::Mat &mesh) const
+{
+    assert(rotation_matrix.size() == (size_t)height_ * 9);
+    mesh.create(getMeshSize(), CV_32FC2);
+    ThreadPool::getInstance().parallelFor(0, mesh.rows, [&](int32_t begin, int32_t end) {
+        for (int i = begin; i < end; ++i)
+        {
+            cv::Vec2f *vertex = mesh.ptr<cv::Vec2f>(i);
+            for (int j = 0; j < mesh.cols; ++j)
+            {
+                if (!getSourcePosition(rotation_matrix.data(), (float)(j * grid_size_), (float)(i * grid_size_), vertex[j][0], vertex[j][1]))
+                {
+                    vertex[j] = cv::Vec2f(-1e6f, -1e6f);
+                }
+            }
+        }
+    }, ThreadPool::Priority::High);
+}
+
+/**
+ * @brief Maximum distance between the exact and the interpolated source position in pixel.
+ * @details Bilinear interpolation error is evaluated on the center of every cell, where it is the largest for a smooth warp.
+ **/
+double CpuStabilizer::getMeshError(const std::vector<float> &rotation_matrix, const cv::Mat &mesh) const
+{
+    std::vector<double> row_errors(mesh.rows - 1, 0.0);
+    ThreadPool::getInstance().parallelFor(0, mesh.rows - 1, [&](int32_t begin, int32_t end) {
+        for (int i = begin; i < end; ++i)
+        {
+            float v = (i + 0.5f) * grid_size_;
+            if (v > height_ - 1)
+            {
+                continue;
+            }
+            const cv::Vec2f *top = mesh.ptr<cv::Vec2f>(i);
+            const cv::Vec2f *bottom = mesh.ptr<cv::Vec2f>(i + 1);
+            for (int j = 0; j < mesh.cols - 1; ++j)
+            {
+                float u = (j + 0.5f) * grid_size_;
+                float src_u, src_v;
+                if ((u > width_ - 1) || !getSourcePosition(rotation_matrix.data(), u, v, src_u, src_v))
+                {
+                    continue;
+                }
+                cv::Vec2f interpolated = (top[j] + top[j + 1] + bottom[j] + bottom[j + 1]) * 0.25f;
+                row_errors[i] = std::max(row_errors[i], (double)std::hypot(interpolated[0] - src_u, interpolated[1] - src_v));
+            }
+        }
+    }, ThreadPool::Priority::High);
+    return row_errors.empty() ? 0.0 : *std::max_element(row_errors.begin(), row_errors.end());
+}
+
+void CpuStabilizer::interpolateMap(const cv::Mat &mesh, int row_begin, int row_end)
+{
+    const float step = 1.f / grid_size_;
+    for (int v = row_begin; v < row_end; ++v)
+    {
+        int i = v / grid_size_;
+        float b = (v - i * grid_size_) * step;
+        const cv::Vec2f *top = mesh.ptr<cv::Vec2f>(i);
+        const cv::Vec2f *bottom = mesh.ptr<cv::Vec2f>(i + 1);
+        float *map_x = map_x_.ptr<float>(v);
+        float *map_y = map_y_.ptr<float>(v);
+        for (int u = 0; u < width_; ++u)
+        {
+            int j = u / grid_size_;
+            float a = (u - j * grid_size_) * step;
+            cv::Vec2f p = (top[j] * (1.f - a) + top[j + 1] * a) * (1.f - b) + (bottom[j] * (1.f - a) + bottom[j + 1] * a) * b;
+            map_x[u] = p[0];
+            map_y[u] = p[1];
+        }
+    }
+}
+
+void CpuStabilizer::warp(const cv::UMat &src, const std::vector<float> &rotation_matrix, cv::UMat &dst)
+{
+    assert(rotation_matrix.size() == (size_t)height_ * 9);
+    if (grid_size_ > 0)
+    {
+        generateMesh(rotation_matrix, mesh_);
+        warp(src, mesh_, dst);
+        return;
+    }
+    int tiles = (height_ + tile_rows_ - 1) / tile_rows_;
+    ThreadPool::getInstance().parallelFor(0, tiles, [&](int32_t begin, int32_t end) {
+        for (int tile = begin; tile < end; ++tile)
+        {
+            generateMap(rotation_matrix, tile * tile_rows_, std::min((tile + 1) * tile_rows_, height_));
+        }
+    }, ThreadPool::Priority::High);
+    remap(src, dst);
+}
+
+/**
+ * @brief Sample the source frame at the map on host memory.
+ * @details cv::remap of UMat would run on OpenCL when it is available, the frames are mapped to cv::Mat instead.
+ **/
+void CpuStabilizer::remap(const cv::UMat &src, cv::UMat &dst) const
+{
+    cv::Mat src_mat = src.getMat(cv::ACCESS_READ);
+    cv::Mat dst_mat = dst.getMat(cv::ACCESS_WRITE);
+    assert((dst_mat.size() == map_x_.size()) && (dst_mat.type() == src_mat.type()));
+    cv::remap(src_mat, dst_mat, map_x_, map_y_, cv::INTER_LINEAR, cv::BORDER_CONSTANT, cv::Scalar(0, 0, 0, 0));
+}
+
+/**
+ * @brief Warp with source positions interpolated from the mesh made by generateMesh().
+ **/
+void CpuStabilizer::warp(const cv::UMat &src, const cv::Mat &mesh, cv::UMat &dst)
+{
+    assert(grid_size_ > 0);
+    assert(mesh.size() == getMeshSize());
+    int tiles = (height_ + tile_rows_ - 1) / tile_rows_;
+    ThreadPool::getInstance().parallelFor(0, tiles, [&](int32_t begin, int32_t end) {
+        for (int tile = begin; tile < end; ++tile)
+        {
+            interpolateMap(mesh, tile * tile_rows_, std::min((tile + 1) * tile_rows_, height_));
+        }
+    }, ThreadPool::Priority::High);
+    remap(src, dst);
+}
@@ -29,9 +29,7 @@
 *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 *************************************************************************/
-#include <stdio.h>
-#include "levenbergMarquardt.hpp"
-#include "camera_information.h"
+#include "distortion.h"
 
 //void calcDistortCoeff(const cv::Mat &matIntrinsic, const cv::Mat &matDistort, const cv::Size &imageSize, cv::Mat &matInvDistort){
 void calcInverseDistortCoeff(CameraInformation &camera_info){
@@ -96,4 +94,71 @@ void calcInverseDistortCoeff(CameraInformation &camera_info){
     camera_info.inverse_k2_ = distortionCoeff[1];
     camera_info.inverse_p1_ = distortionCoeff[2];
     camera_info.inverse_p2_ = distortionCoeff[3];
+
+    camera_info.undistortion_table_ = std::make_shared<UndistortionTable>(camera_info);
+}
+
+UndistortionTable::UndistortionTable(const CameraInformation &camera_info, int step) : step_(step),
+                                                                                        table_(camera_info.height_ / step + 2, camera_info.width_ / step + 2, CV_32FC2)
+{
+    cv::parallel_for_(cv::Range(0, table_.rows), [&](const cv::Range &range) {
+        for (int i = range.start; i < range.end; ++i)
+        {
+            cv::Vec2f *row = table_.ptr<cv::Vec2f>(i);
+            for (int j = 0; j < table_.cols; ++j)
+            {
+                Eigen::Array2d x = undistortPoint(camera_info, Eigen::Array2d(j * step_, i * step_));
+                row[j] = cv::Vec2f((float)x[0], (float)x[1]);
+            }
+        }
+    });
+}
+
+/**
+ * @brief Apply the inverse distortion parameters to a pixel.
+ * @return Undistorted normalized coordinates.
+ **/
+Eigen::Array2d UndistortionTable::undistortPoint(const CameraInformation &camera_info, const Eigen::Array2d &p)
+{
+    const double &ik1 = camera_info.inverse_k1_;
+    const double &ik2 = camera_info.inverse_k2_;
+    const double &ip1 = camera_info.inverse_p1_;
+    const double &ip2 = camera_info.inverse_p2_;
+    Eigen::Array2d x1((p[0] - camera_info.cx_) / camera_info.fx_, (p[1] - camera_info.cy_) / camera_info.fy_);
+    double r2 = x1.matrix().squaredNorm();
+    Eigen::Array2d x2 = x1 * (1.0 + ik1 * r2 + ik2 * r2 * r2);
+    x2[0] += 2.0 * ip1 * x1[0] * x1[1] + ip2 * (r2 + 2 * x1[0] * x1[0]);
+    x2[1] += ip1 * (r2 + 2.0 * x1[1] * x1[1]) + 2.0 * ip2 * x1[0] * x1[1];
+    return x2;
+}
+
+/**
+ * @brief Undistorted normalized coordinates of a pixel, bilinearly interpolated from the table.
+ **/
+Eigen::Array2d UndistortionTable::undistort(const Eigen::Array2d &p) const
+{
+    double u = p[0] / step_;
+    double v = p[1] / step_;
+    int j = std::min(std::max((int)std::floor(u), 0), table_.cols - 2);
+    int i = std::min(std::max((int)std::floor(v), 0), table_.rows - 2);
+    double a = u - j;
+    double b = v - i;
+    const cv::Vec2f *top = table_.ptr<cv::Vec2f>(i);
+    const cv::Vec2f *bottom = table_.ptr<cv::Vec2f>(i + 1);
+    Eigen::Array2d x;
+    for (int k = 0; k < 2; ++k)
+    {
+        x[k] = (top[j][k] * (1.0 - a) + top[j + 1][k] * a) * (1.0 - b) + (bottom[j][k] * (1.0 - a) + bottom[j + 1][k] * a) * b;
+    }
+    return x;
+}
+
+const cv::Mat &UndistortionTable::getTable() const
+{
+    return table_;
+}
+
+int UndistortionTable::getStep() const
+{
+    return step_;
 }
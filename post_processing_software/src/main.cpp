@@ -31,9 +31,11 @@
 *************************************************************************/
 
 #include <stdio.h>
+#include <string.h>
 #include <Eigen/Dense>
 #include <opencv2/opencv.hpp>
 #include <memory>
+#include <chrono>
 #include "virtual_gimbal_manager.h"
 #include "json_tools.hpp"
 #include "rotation_param.h"
@@ -58,15 +60,27 @@ int main(int argc, char **argv)
     bool output = false;
     bool show_image = true;
     const char *kernel_name = "cl/stabilizer_kernel.cl";
-    const char *kernel_function = "stabilizer_function";
+    const char *kernel_function = NULL;
     // bool debug_speedup = false;
     double zoom = 1.0;
     int32_t fileter_length = 199;
     int opt;
     int queue_size = 10;
+    RenderBackend render_backend = RenderBackend::Auto;
+    WarpMode warp_mode = WarpMode::Forward;
+    int32_t mesh_grid_size = 16;
+    int async_frames = 1;
+    bool bgra_frame = false;
+    int tile_size = 0;
+    int threads = 0;
+    double keyframe_tolerance = 0.0;
+    bool recursive_filter = false;
+    FilterStrengthSolver filter_strength_solver = FilterStrengthSolver::Bisection;
+    int32_t zoom_filter_strength = -1;
+    int32_t zoom_segment_frames = 0;
     //    Eigen::Quaterniond camera_rotation;
 
-    while ((opt = getopt(argc, argv, "j:i:c:l:w:z:k:f:o::n::")) != -1)
+    while ((opt = getopt(argc, argv, "j:i:c:l:w:z:k:f:b:m:g:a:p:t:r:e:s:x:y:u:o::n::")) != -1)
     {
         switch (opt)
         {
@@ -101,6 +115,75 @@ int main(int argc, char **argv)
         case 'f':
             kernel_function = optarg;
             break;
+        case 'b': //rendering backend, auto, opencl or cpu
+            if (0 == strcmp(optarg, "opencl"))
+            {
+                render_backend = RenderBackend::OpenCL;
+            }
+            else if (0 == strcmp(optarg, "cpu"))
+            {
+                render_backend = RenderBackend::CPU;
+            }
+            else
+            {
+                render_backend = RenderBackend::Auto;
+            }
+            break;
+        case 'm': //warp mode, forward, inverse or mesh
+            if (0 == strcmp(optarg, "inverse"))
+            {
+                warp_mode = WarpMode::Inverse;
+            }
+            else if (0 == strcmp(optarg, "mesh"))
+            {
+                warp_mode = WarpMode::Mesh;
+            }
+            else
+            {
+                warp_mode = WarpMode::Forward;
+            }
+            break;
+        case 'g': //cell size of the mesh warp mode in pixel
+            mesh_grid_size = std::stoi(optarg);
+            break;
+        case 'a': //number of frames in flight on OpenCL device
+            async_frames = std::stoi(optarg);
+            break;
+        case 'p': //frame format, bgra forces image2d_t kernels in inverse and mesh mode
+            bgra_frame = (0 == strcmp(optarg, "bgra"));
+            break;
+        case 't': //tile size of tiled rendering in pixel
+            tile_size = std::stoi(optarg);
+            break;
+        case 'r': //number of worker threads shared by all stages
+            threads = std::stoi(optarg);
+            break;
+        case 'e': //tolerance of rotations interpolated between keyframe rows in pixel
+            keyframe_tolerance = std::stod(optarg);
+            break;
+        case 's': //smoothing filter, gaussian or recursive
+            recursive_filter = (0 == strcmp(optarg, "recursive"));
+            break;
+        case 'x': //solver of the filter strength, bisection, warm or path
+            if (0 == strcmp(optarg, "warm"))
+            {
+                filter_strength_solver = FilterStrengthSolver::WarmStart;
+            }
+            else if (0 == strcmp(optarg, "path"))
+            {
+                filter_strength_solver = FilterStrengthSolver::Path;
+            }
+            else
+            {
+                filter_strength_solver = FilterStrengthSolver::Bisection;
+            }
+            break;
+        case 'y': //filter strength to print the minimum zoom of, without stabilization
+            zoom_filter_strength = std::stoi(optarg);
+            break;
+        case 'u': //length of segments of the minimum zoom in frame
+            zoom_segment_frames = std::stoi(optarg);
+            break;
         case 'o':
             output = true;
             break;
@@ -124,9 +207,60 @@ int main(int argc, char **argv)
     }
 
 
+    if (NULL == kernel_function)
+    {
+        switch (warp_mode)
+        {
+        case WarpMode::Inverse:
+            kernel_function = bgra_frame ? "stabilizer_function_inverse" : "stabilizer_function_inverse_bgr";
+            break;
+        case WarpMode::Mesh:
+            kernel_function = bgra_frame ? "stabilizer_function_mesh" : "stabilizer_function_mesh_bgr";
+            break;
+        default:
+            kernel_function = "stabilizer_function";
+            break;
+        }
+    }
+
     VirtualGimbalManager manager(queue_size);
     manager.kernel_function = kernel_function;
     manager.kernel_name = kernel_name;
+    manager.render_backend = render_backend;
+    manager.warp_mode = warp_mode;
+    // Gather kernels read and write the packed BGR frames of the decoder and the encoder directly.
+    manager.frame_format = (((WarpMode::Forward == warp_mode) && (RenderBackend::CPU != render_backend)) || bgra_frame) ? FrameFormat::BGRA : FrameFormat::BGR;
+    if (mesh_grid_size <= 0)
+    {
+        std::cerr << "Mesh grid size must be positive." << std::endl << std::flush;
+        throw "Mesh grid size must be positive.";
+    }
+    manager.mesh_grid_size = mesh_grid_size;
+    if (async_frames <= 0)
+    {
+        std::cerr << "Number of frames in flight must be positive." << std::endl << std::flush;
+        throw "Number of frames in flight must be positive.";
+    }
+    manager.async_frames = async_frames;
+    if (tile_size < 0)
+    {
+        std::cerr << "Tile size must not be negative." << std::endl << std::flush;
+        throw "Tile size must not be negative.";
+    }
+    manager.tile_size = tile_size;
+    if (threads < 0)
+    {
+        std::cerr << "Number of threads must not be negative." << std::endl << std::flush;
+        throw "Number of threads must not be negative.";
+    }
+    ThreadPool::setConcurrency(threads);
+    if (keyframe_tolerance < 0.0)
+    {
+        std::cerr << "Keyframe tolerance must not be negative." << std::endl << std::flush;
+        throw "Keyframe tolerance must not be negative.";
+    }
+    manager.keyframe_tolerance = keyframe_tolerance;
+    manager.filter_strength_solver = filter_strength_solver;
 
     // TODO:Check kernel availability here. Build once.
 
@@ -172,8 +306,16 @@ int main(int argc, char **argv)
 //     vgp::plot(correlation, "correlation", legends_angular_velocity);
 // #endif 
 
-    auto fir_filter = std::make_shared<NormalDistributionFilter>();
-    manager.setFilter(fir_filter);
+    FilterPtr filter;
+    if (recursive_filter)
+    {
+        filter = std::make_shared<RecursiveGaussianFilter>();
+    }
+    else
+    {
+        filter = std::make_shared<NormalDistributionFilter>();
+    }
+    manager.setFilter(filter);
     manager.setMaximumGradient(0.5);
 
     auto table = manager.getSyncTable(30.0,999);
@@ -191,13 +333,44 @@ int main(int argc, char **argv)
     }
 
 
-    Eigen::VectorXd filter_coefficients = manager.getFilterCoefficients(zoom,fir_filter,table,fileter_length,0); // Zero is the weakest value since apply no filter, output is equal to input.
+    SyncTable sync_table(table);
+
+    if (recursive_filter)
+    {
+        // The strongest filter deviates the most.
+        int32_t checked_strength = (0 <= zoom_filter_strength) ? zoom_filter_strength : fileter_length;
+        double deviation = manager.getRecursiveFilterDeviation(filter, checked_strength);
+        printf("Recursive filter deviates from the gaussian filter by %.1f%% at filter strength %d.\r\n", deviation * 100.0, checked_strength);
+        if (0.05 < deviation)
+        {
+            printf("Warning: Recursive filter is not a replacement of the gaussian filter here, use -s gaussian.\r\n");
+        }
+    }
+
+    if (0 <= zoom_filter_strength)
+    {
+        const auto start_time = std::chrono::steady_clock::now();
+        Eigen::VectorXd minimum_zoom = manager.getMinimumZoom(filter, sync_table, zoom_filter_strength);
+        printf("Minimum zoom of filter strength %d: %f in %.1f seconds.\r\n", zoom_filter_strength, minimum_zoom.maxCoeff(),
+               std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count());
+        if (0 < zoom_segment_frames)
+        {
+            for (int32_t begin = 0; begin < minimum_zoom.rows(); begin += zoom_segment_frames)
+            {
+                int32_t length = std::min<int32_t>(zoom_segment_frames, minimum_zoom.rows() - begin);
+                printf("(%d - %d) %f\r\n", begin, begin + length - 1, minimum_zoom.segment(begin, length).maxCoeff());
+            }
+        }
+        return 0;
+    }
+
+    Eigen::VectorXd filter_coefficients = manager.getFilterCoefficients(zoom,filter,sync_table,fileter_length,0); // Zero is the weakest value since apply no filter, output is equal to input.
 #ifdef __DEBUG_ONLY
     std::vector<string> legends_angular_velocity = {"c"};
     vgp::plot(filter_coefficients, "filter_coefficients", legends_angular_velocity);
 #endif
 
-    manager.spin(zoom,fir_filter,filter_coefficients,table, show_image);
+    manager.spin(zoom,filter,filter_coefficients,sync_table, show_image);
 
     return 0;
 }
\ No newline at end of file
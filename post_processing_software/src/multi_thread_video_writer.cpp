@@ -40,7 +40,77 @@
 //     return data.size();
 // }
 
-MultiThreadVideoWriter::MultiThreadVideoWriter(std::string output_pass, Video &video_param, size_t queue_size) : write_data_(queue_size)
+UMatPool::UMatPool(cv::Size size, int type) : size_(size), type_(type), usage_(cv::USAGE_ALLOCATE_DEVICE_MEMORY), allocated_count_(0)
+{
+}
+
+UMatPtr UMatPool::acquire()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!buffers_.empty())
+        {
+            UMatPtr p = std::move(buffers_.back());
+            buffers_.pop_back();
+            return p;
+        }
+        ++allocated_count_;
+    }
+    return UMatPtr(new cv::UMat(size_, type_, usage_));
+}
+
+/**
+ * @brief Return the buffer to the pool. Buffers of another format are discarded.
+ **/
+void UMatPool::release(UMatPtr &p)
+{
+    if (!p)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if ((p->size() == size_) && (p->type() == type_) && (p->usageFlags == usage_))
+    {
+        buffers_.emplace_back(std::move(p));
+    }
+    else
+    {
+        --allocated_count_;
+        p.reset();
+    }
+}
+
+size_t UMatPool::getAllocatedCount()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return allocated_count_;
+}
+
+/**
+ * @brief Change the format of buffers. Buffers of the old format are discarded when they come back.
+ * @param [in] usage Where buffers are allocated. Host memory keeps frames out of device memory.
+ **/
+void UMatPool::setFormat(cv::Size size, int type, cv::UMatUsageFlags usage)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if ((size == size_) && (type == type_) && (usage == usage_))
+    {
+        return;
+    }
+    size_ = size;
+    type_ = type;
+    usage_ = usage;
+    allocated_count_ -= buffers_.size();
+    buffers_.clear();
+}
+
+int UMatPool::getType()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return type_;
+}
+
+MultiThreadVideoWriter::MultiThreadVideoWriter(std::string output_pass, Video &video_param, size_t queue_size, UMatPoolPtr pool) : write_data_(queue_size), pool_(pool)
 {
     struct stat st;
     if (!stat(output_pass.c_str(), &st))
@@ -56,30 +126,29 @@ MultiThreadVideoWriter::MultiThreadVideoWriter(std::string output_pass, Video &v
         throw "Error: Can't open video writer.";
     }
 
-    is_writing = true;
     th1 = std::thread(&MultiThreadVideoWriter::videoWriterProcess, this); // Run thread
 }
 
 void MultiThreadVideoWriter::videoWriterProcess()
 {
-    while (1)
+    cv::UMat bgr;
+    UMatPtr data_to_write;
+    // Frames pushed before join() are written, then the queue is closed.
+    while (write_data_.pop(data_to_write))
     {
-        if (!write_data_.empty())
+        if (4 == data_to_write->channels())
         {
-            UMatPtr data_to_write;
-            cv::UMat bgr;
-            write_data_.get(data_to_write);
             cv::cvtColor(*data_to_write, bgr, cv::COLOR_BGRA2BGR);
             video_writer << bgr;
-            write_data_.pop();
         }
         else
         {
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            // Already in the layout of the encoder.
+            video_writer << *data_to_write;
         }
-        if ((!is_writing) && write_data_.empty())
+        if (pool_)
         {
-            return;
+            pool_->release(data_to_write);
         }
     }
 }
@@ -126,18 +195,17 @@ MultiThreadVideoWriter::~MultiThreadVideoWriter()
 void MultiThreadVideoWriter::join()
 {
     std::cout << "Multi thread video writer : Terminating..." << std::endl;
-    is_writing = false;
+    write_data_.close();
     th1.join();
     std::cout << "Multi thread video writer : Done." << std::endl;
 }
 
 int MultiThreadVideoWriter::push(UMatPtr &p)
 {
-    write_data_.push(p);
-    return 0;
+    return write_data_.push(p) ? 0 : 1;
 }
 
-MultiThreadVideoReader::MultiThreadVideoReader(std::string input_path,size_t queue_size) : read_data_(queue_size),video_capture(input_path)
+MultiThreadVideoReader::MultiThreadVideoReader(std::string input_path,size_t queue_size, UMatPoolPtr pool) : read_data_(queue_size),pool_(pool),video_capture(input_path)
 {
     if (!video_capture.isOpened())
     {
@@ -145,29 +213,44 @@ MultiThreadVideoReader::MultiThreadVideoReader(std::string input_path,size_t que
                   << std::flush;
         throw;
     }
-    is_reading = true;
+    if (!pool_)
+    {
+        pool_ = std::make_shared<UMatPool>(cv::Size(video_capture.get(cv::CAP_PROP_FRAME_WIDTH), video_capture.get(cv::CAP_PROP_FRAME_HEIGHT)), CV_8UC4);
+    }
     th1 = std::thread(&MultiThreadVideoReader::videoReaderProcess, this); // Run thread
 }
 
 void MultiThreadVideoReader::videoReaderProcess()
 {
+    // Decoded frame is reused, and converted into a recycled buffer.
+    cv::Mat frame;
     while (1)
     {
-        UMatPtr umat_src(new cv::UMat(cv::Size(video_capture.get(cv::CAP_PROP_FRAME_WIDTH), video_capture.get(cv::CAP_PROP_FRAME_HEIGHT)),
-                                      CV_8UC4,
-                                      cv::ACCESS_READ,
-                                      cv::USAGE_ALLOCATE_DEVICE_MEMORY)); //mat_src.getUMat(cv::ACCESS_READ, cv::USAGE_ALLOCATE_DEVICE_MEMORY);
-        video_capture >> *umat_src;
-        if (umat_src->empty())
+        UMatPtr umat_src = pool_->acquire();
+        bool decoded;
+        if (4 == umat_src->channels())
         {
-            is_reading = false;
+            decoded = video_capture.read(frame);
+            if (decoded)
+            {
+                cv::cvtColor(frame, *umat_src, cv::COLOR_BGR2BGRA);
+            }
+        }
+        else
+        {
+            // Packed BGR kernels take the decoded layout as it is.
+            decoded = video_capture.read(*umat_src);
+        }
+        if (!decoded)
+        {
+            pool_->release(umat_src);
+            read_data_.close();
             return;
         }
-        cv::cvtColor(*umat_src, *umat_src, cv::COLOR_BGR2BGRA);
-        read_data_.push(umat_src);
-
-        if (!is_reading)
+        // The queue is closed by join() before the end of the video.
+        if (!read_data_.push(umat_src))
         {
+            pool_->release(umat_src);
             return;
         }
     }
@@ -176,26 +259,28 @@ void MultiThreadVideoReader::videoReaderProcess()
 void MultiThreadVideoReader::join()
 {
     std::cout << "Multi thread video reader : Terminating..." << std::endl;
-    is_reading = false;
-    read_data_.clear();
+    read_data_.close();
     th1.join();
     std::cout << "Multi thread video reader : Done." << std::endl;
 }
 
 int MultiThreadVideoReader::get(UMatPtr &p)
 {
-    while (read_data_.empty())
+    // Fails after the last frame.
+    if (!read_data_.pop(p))
     {
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
-        if (!is_reading)
-        {
-            p = nullptr;
-            return 1;
-        }
+        p = nullptr;
+        return 1;
     }
-    int retval = read_data_.get(p);
-    read_data_.pop();
-    return retval;
+    return 0;
+}
+
+/**
+ * @brief Return the frame to the pool after rendering.
+ **/
+void MultiThreadVideoReader::release(UMatPtr &p)
+{
+    pool_->release(p);
 }
 
 MultiThreadVideoReader::~MultiThreadVideoReader()
@@ -209,70 +294,200 @@ MultiThreadRotationMatrixGenerator::MultiThreadRotationMatrixGenerator(
     FilterPtr filter,
     AngularVelocityPtr measured_angular_velocity,
     Eigen::VectorXd filter_strength,
-    std::vector<std::pair<int32_t,double>> sync_table,
-    size_t queue_size) : video_parameter(video_parameter),
+    const SyncTable &sync_table,
+    size_t queue_size,
+    bool output_quaternion,
+    double keyframe_tolerance) : video_parameter(video_parameter),
                                     //    resampler_parameter(resampler_parameter),
                                        filter(filter),
                                        measured_angular_velocity(measured_angular_velocity),
                                        filter_strength(filter_strength),
                                        sync_table(sync_table),
-                                     rotation_matrix_(queue_size)
+                                       output_quaternion(output_quaternion),
+                                     queue_size(std::max<size_t>(1, queue_size)),
+                                     keyframe_tolerance(keyframe_tolerance),
+                                     next_block_(0),
+                                     submitted_blocks_(0),
+                                     next_frame_(0),
+                                     blocks_in_flight_(0)
 {
+    const int32_t height = video_parameter->camera_info->height_;
+    // Blocks are small enough to share a frame among all workers near the end of the video.
+    // Interpolated blocks are larger since most of their rows are cheap.
+    block_rows_ = (keyframe_tolerance > 0.0) ? 256 : 64;
+    blocks_per_frame_ = (height + block_rows_ - 1) / block_rows_;
+    total_blocks_ = (video_parameter->video_frames + 1) * blocks_per_frame_;
     is_reading = true;
-    th1 = std::thread(&MultiThreadRotationMatrixGenerator::process, this); // Run thread
+    std::lock_guard<std::mutex> lock(mutex_);
+    schedule();
 }
 
-void MultiThreadRotationMatrixGenerator::process()
+Eigen::Quaterniond MultiThreadRotationMatrixGenerator::getCorrection(int32_t frame, int32_t row)
 {
-    for (int frame = 0; frame <= video_parameter->video_frames; ++frame)
+    double frame_in_row = frame + (video_parameter->camera_info->line_delay_ * (row - video_parameter->camera_info->height_ * 0.5))
+    * video_parameter->getFrequency();
+    // double time_in_row = video_parameter->getInterval() * frame + resampler_parameter->start + video_parameter->camera_info->line_delay_ * (row - video_parameter->camera_info->height_ * 0.5);
+    // printf("frame_in_row:%f time_in_row%f\r\n",measured_angular_velocity->convertEstimatedToMeasuredAngularVelocityFrame(frame_in_row,sync_table)*measured_angular_velocity->getInterval(),time_in_row);
+    return measured_angular_velocity->getCorrectionQuaternionFromFrame(frame_in_row,*filter,filter_strength(frame),sync_table);
+}
+
+void MultiThreadRotationMatrixGenerator::setRotation(int32_t row, const Eigen::Quaterniond &q, float *R)
+{
+    if (output_quaternion)
     {
-        MatrixPtr R(new std::vector<float>(video_parameter->camera_info->height_ * 9));
-        // Calculate Rotation matrix for every line
-        for (int row = 0, e = video_parameter->camera_info->height_; row < e; ++row)
+        Eigen::Map<Eigen::Vector4f>(&R[row * 4], 4) = q.normalized().coeffs().cast<float>();
+    }
+    else
+    {
+        Eigen::Map<Eigen::Matrix<float, 3, 3, Eigen::RowMajor>>(&R[row * 9], 3, 3) = q.matrix().cast<float>();
+    }
+}
+
+/**
+ * @brief Fill rows between keyframes row0 and row1.
+ * @details The middle row is calculated exactly. If slerp of the keyframes is close enough to it,
+ * the other rows are interpolated. Otherwise both halves are processed recursively.
+ **/
+void MultiThreadRotationMatrixGenerator::interpolateRows(int32_t frame,
+                                                         int32_t row0, const Eigen::Quaterniond &q0,
+                                                         int32_t row1, const Eigen::Quaterniond &q1, float *R)
+{
+    if (row1 - row0 <= 1)
+    {
+        return;
+    }
+    int32_t middle = (row0 + row1) / 2;
+    Eigen::Quaterniond q_middle = getCorrection(frame, middle);
+    setRotation(middle, q_middle, R);
+    if (q0.slerp((double)(middle - row0) / (row1 - row0), q1).angularDistance(q_middle) <= keyframe_tolerance)
+    {
+        for (int32_t row = row0 + 1; row < row1; ++row)
         {
-            double frame_in_row = frame + (video_parameter->camera_info->line_delay_ * (row - video_parameter->camera_info->height_ * 0.5))
-            * video_parameter->getFrequency();
-            Eigen::Map<Eigen::Matrix<float, 3, 3, Eigen::RowMajor>>(&(*R)[row * 9], 3, 3) 
-            = measured_angular_velocity->getCorrectionQuaternionFromFrame(frame_in_row,filter->getFilterCoefficient(filter_strength(frame)),sync_table).matrix().cast<float>();
-            
-            // double time_in_row = video_parameter->getInterval() * frame + resampler_parameter->start + video_parameter->camera_info->line_delay_ * (row - video_parameter->camera_info->height_ * 0.5);
-            // printf("frame_in_row:%f time_in_row%f\r\n",measured_angular_velocity->convertEstimatedToMeasuredAngularVelocityFrame(frame_in_row,sync_table)*measured_angular_velocity->getInterval(),time_in_row);
+            if (middle != row)
+            {
+                setRotation(row, q0.slerp((double)(row - row0) / (row1 - row0), q1), R);
+            }
+        }
+    }
+    else
+    {
+        interpolateRows(frame, row0, q0, middle, q_middle, R);
+        interpolateRows(frame, middle, q_middle, row1, q1, R);
+    }
+}
 
+void MultiThreadRotationMatrixGenerator::calculateRows(int32_t frame, int32_t begin, int32_t end, float *R)
+{
+    if (keyframe_tolerance <= 0.0)
+    {
+        // Calculate Rotation matrix for every line
+        for (int row = begin; row < end; ++row)
+        {
+            setRotation(row, getCorrection(frame, row), R);
         }
+        return;
+    }
+
+    // The first and the last rows of a block are keyframes.
+    Eigen::Quaterniond q_begin = getCorrection(frame, begin);
+    setRotation(begin, q_begin, R);
+    if (end - 1 > begin)
+    {
+        Eigen::Quaterniond q_end = getCorrection(frame, end - 1);
+        setRotation(end - 1, q_end, R);
+        interpolateRows(frame, begin, q_begin, end - 1, q_end, R);
+    }
+}
 
-        rotation_matrix_.push(R);
+/**
+ * @brief Submit tasks to the thread pool, as many as the workers. mutex_ must be locked.
+ * @details Each task calculates a block, which is chosen when the task runs.
+ **/
+void MultiThreadRotationMatrixGenerator::schedule()
+{
+    ThreadPool &pool = ThreadPool::getInstance();
+    // Don't run ahead of get() more than queue_size frames.
+    while (is_reading && (submitted_blocks_ < total_blocks_) && (blocks_in_flight_ < (int32_t)pool.getConcurrency()) &&
+           (submitted_blocks_ / blocks_per_frame_ < next_frame_ + (int32_t)queue_size))
+    {
+        int32_t frame = submitted_blocks_ / blocks_per_frame_;
+        ++submitted_blocks_;
+        ++blocks_in_flight_;
+        pool.submit([this] { process(); },
+                    (frame == next_frame_) ? ThreadPool::Priority::High : ThreadPool::Priority::Low);
+    }
+}
 
-        if (!is_reading)
+void MultiThreadRotationMatrixGenerator::process()
+{
+    const int32_t height = video_parameter->camera_info->height_;
+    int32_t frame, block;
+    float *R;
+    {
+        // Take the earliest block, since the pool may run tasks submitted later first.
+        std::lock_guard<std::mutex> lock(mutex_);
+        frame = next_block_ / blocks_per_frame_;
+        block = next_block_ % blocks_per_frame_;
+        ++next_block_;
+        PendingFrame &pending = rotation_matrix_[frame];
+        if (!pending.R)
         {
-            break;
+            pending.R.reset(new std::vector<float>(height * (output_quaternion ? 4 : 9)));
+            pending.remaining_blocks = blocks_per_frame_;
         }
-        // std::cout << "\r\n frame: " << frame << std::endl << std::flush;
+        // Each block writes its own rows, so that the buffer is filled without the lock.
+        R = pending.R->data();
+    }
+    calculateRows(frame, block * block_rows_, std::min(height, (block + 1) * block_rows_), R);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    --blocks_in_flight_;
+    if ((0 == --rotation_matrix_[frame].remaining_blocks) || (0 == blocks_in_flight_))
+    {
+        block_done_.notify_all();
     }
+    schedule();
 }
 
 int MultiThreadRotationMatrixGenerator::get(MatrixPtr &p)
 {
-    while (rotation_matrix_.empty())
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (next_frame_ > video_parameter->video_frames)
+    {
+        p = nullptr;
+        return 1;
+    }
+    auto ready = [&] {
+        auto it = rotation_matrix_.find(next_frame_);
+        return (rotation_matrix_.end() != it) && (0 == it->second.remaining_blocks);
+    };
+    if (!ready())
     {
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
-        if (!is_reading)
-        {
-            p = nullptr;
-            return 1;
-        }
         std::cout << "Empty:" << __FILE__ << " : line " << __LINE__ << std::endl;
+        block_done_.wait(lock, [&] { return !is_reading || ready(); });
+    }
+    if (!is_reading)
+    {
+        p = nullptr;
+        return 1;
     }
-    int retval = rotation_matrix_.get(p);
-    rotation_matrix_.pop();
-    return retval;
+    auto it = rotation_matrix_.find(next_frame_);
+    p = std::move(it->second.R);
+    rotation_matrix_.erase(it);
+    ++next_frame_;
+    schedule();
+    return 0;
 }
 
 void MultiThreadRotationMatrixGenerator::join()
 {
     std::cout << "Multi thread rotation matrix generator : Terminating..." << std::endl;
+    // Blocks in the thread pool still write to the frames.
+    std::unique_lock<std::mutex> lock(mutex_);
     is_reading = false;
+    block_done_.notify_all();
+    block_done_.wait(lock, [&] { return 0 == blocks_in_flight_; });
     rotation_matrix_.clear();
-    th1.join();
     std::cout << "Multi thread rotation matrix generator : Done." << std::endl;
 }
 
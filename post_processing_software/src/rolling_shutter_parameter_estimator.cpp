@@ -30,6 +30,7 @@
 *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 *************************************************************************/
 #include <stdio.h>
+#include <string.h>
 #include <Eigen/Dense>
 #include <opencv2/opencv.hpp>
 #include <memory>
@@ -51,9 +52,10 @@ int main(int argc, char **argv)
     char *lensName = NULL;
     char *jsonPass = NULL;
     bool debug_speedup = false;
+    bool magnus_integrator = false;
     int opt;
 
-    while ((opt = getopt(argc, argv, "j:i:c:l:d::")) != -1)
+    while ((opt = getopt(argc, argv, "j:i:c:l:r:d::")) != -1)
     {
         switch (opt)
         {
@@ -69,6 +71,9 @@ int main(int argc, char **argv)
         case 'l':
             lensName = optarg;
             break;
+        case 'r': //integrator of the angular velocity, euler or magnus
+            magnus_integrator = (0 == strcmp(optarg, "magnus"));
+            break;
         case 'd':
             debug_speedup = true;
             break;
@@ -83,6 +88,10 @@ int main(int argc, char **argv)
     }
 
     VirtualGimbalManager manager;
+    if (magnus_integrator)
+    {
+        manager.rotation_integrator = RotationQuaternion::Integrator::Magnus;
+    }
     std::shared_ptr<CameraInformation> camera_info(new CameraInformationJsonParser(cameraName, lensName, VirtualGimbalManager::getVideoSize(videoPass).c_str()));
     // calcInverseDistortCoeff(*camera_info);
     manager.setMeasuredAngularVelocity(jsonPass, camera_info);
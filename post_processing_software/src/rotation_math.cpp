@@ -30,4 +30,33 @@
 *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 *************************************************************************/
 #include "rotation_math.h"
+#include <cassert>
+#include <cmath>
 
+// Every expression runs over whole columns, so that Eigen vectorizes them with SIMD.
+void Vectors2Quaternions(const Eigen::Ref<const Eigen::MatrixX3d> &w, Eigen::Ref<Eigen::MatrixX4d> q)
+{
+    assert(w.rows() == q.rows());
+    Eigen::ArrayXd theta = (w.col(0).array().square() + w.col(1).array().square() + w.col(2).array().square()).sqrt();
+    Eigen::ArrayXd theta_2 = theta * 0.5;
+    // sin(theta/2)/theta, with Maclaurin expansion around zero.
+    Eigen::ArrayXd scale = (theta > EPS_Q).select(theta_2.sin() / theta, 0.5 - theta.square() * (1.0 / 48.0));
+    for (int i = 0; i < 3; ++i)
+    {
+        q.col(i).array() = w.col(i).array() * scale;
+    }
+    q.col(3).array() = theta_2.cos();
+}
+
+void Quaternions2Vectors(const Eigen::Ref<const Eigen::MatrixX4d> &q, Eigen::Ref<Eigen::MatrixX3d> w)
+{
+    assert(w.rows() == q.rows());
+    Eigen::ArrayXd denom = (1.0 - q.col(3).array().square()).max(0.0).sqrt();
+    Eigen::ArrayXd theta = denom.binaryExpr(q.col(3).array(), [](double y, double x) { return std::atan2(y, x); });
+    // Zero vector without rotation, where it would be divided by zero.
+    Eigen::ArrayXd scale = (denom < EPS_Q).select(0.0, 2.0 * theta / denom);
+    for (int i = 0; i < 3; ++i)
+    {
+        w.col(i).array() = q.col(i).array() * scale;
+    }
+}
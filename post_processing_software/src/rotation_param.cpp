@@ -150,10 +150,57 @@ Eigen::Quaterniond Rotation::getDiffQuaternion(double index)
     return Eigen::Quaterniond();
 }
 
-RotationQuaternion::RotationQuaternion(AngularVelocityPtr angular_velocity, ResamplerParameter &resampler) : angular_velocity_(angular_velocity), resampler_(resampler)
+RotationQuaternion::RotationQuaternion(AngularVelocityPtr angular_velocity, ResamplerParameter &resampler, Integrator integrator) : angular_velocity_(angular_velocity), resampler_(resampler)
 {
-    double frame = resampler_.start * angular_velocity_->getFrequency();
-    angle_[(int)frame] = Eigen::Quaterniond(1, 0, 0, 0);
+    // Orientation is the identity at the start frame. Before the first frame the angular velocity is zero.
+    int32_t start = std::max((int32_t)(resampler_.start * angular_velocity_->getFrequency()), 0);
+    int32_t frames = std::max(angular_velocity_->getFrames(), start);
+    angle_.resize(frames + 1);
+    angle_[start] = Eigen::Quaterniond(1, 0, 0, 0);
+    for (int32_t i = start; i < frames; ++i)
+    {
+        angle_[i + 1] = (angle_[i] * getIncrement(i, integrator)).normalized();
+    }
+    for (int32_t i = start - 1; i >= 0; --i)
+    {
+        angle_[i] = (angle_[i + 1] * getIncrement(i, integrator).conjugate()).normalized();
+    }
+}
+
+/**
+ * @brief Rotation from a frame to the next one.
+ **/
+Eigen::Quaterniond RotationQuaternion::getIncrement(int32_t frame, Integrator integrator)
+{
+    if ((Integrator::Euler == integrator) || (frame >= angular_velocity_->getFrames()))
+    {
+        return angular_velocity_->getAngularVelocity((size_t)frame);
+    }
+    // Neighbours are extrapolated linearly at the edges of the data, so that the edges don't see a jump to zero.
+    const int32_t frames = angular_velocity_->getFrames();
+    Eigen::Vector3d w = angular_velocity_->getAngularVelocityVector((size_t)frame);
+    if (frames < 3)
+    {
+        return Vector2Quaternion<double>(w);
+    }
+    Eigen::Vector3d w_previous, w_next;
+    if (0 == frame)
+    {
+        w_next = angular_velocity_->getAngularVelocityVector((size_t)(frame + 1));
+        w_previous = 2.0 * w - w_next;
+    }
+    else if (frames - 1 == frame)
+    {
+        w_previous = angular_velocity_->getAngularVelocityVector((size_t)(frame - 1));
+        w_next = 2.0 * w - w_previous;
+    }
+    else
+    {
+        w_previous = angular_velocity_->getAngularVelocityVector((size_t)(frame - 1));
+        w_next = angular_velocity_->getAngularVelocityVector((size_t)(frame + 1));
+    }
+    Eigen::Vector3d omega = w + (w_previous - 2.0 * w + w_next) / 24.0 + w.cross(w_next - w_previous) / 24.0;
+    return Vector2Quaternion<double>(omega);
 }
 
 Eigen::Quaterniond RotationQuaternion::getRotationQuaternion(double time)
@@ -163,75 +210,85 @@ Eigen::Quaterniond RotationQuaternion::getRotationQuaternion(double time)
     assert(frame >= 0);
     int integer_frame = floor(frame);
 
-    // std::cout << "angle_.rbegin()->first : " << angle_.rbegin()->first << std::endl;
-    // std::cout << "angle_.begin()->first : " << angle_.begin()->first << std::endl;
-    // std::cout << "*angle_.begin() : " << angle_.begin()->second.coeffs().transpose() << std::endl;
-    // Check data availability.
-    // If there is no available data, Generate it.
-    if (angle_.rbegin()->first < (integer_frame + 1))
-    {
-        for (int i = angle_.rbegin()->first; i <= integer_frame; ++i)
-        { //TODO: Angular Velocity と Angle の対応関係これでよい？1個ずれない？
-            // Eigen::Vector3d vec = angular_velocity_->data.row(i).transpose() * angular_velocity_->getInterval();
-            Eigen::Quaterniond diff = angular_velocity_->getAngularVelocity(i); // Vector2Quaternion<double>(angular_velocity_->data.row(i).transpose() * angular_velocity_->getInterval());
-            angle_[i + 1] = (angle_[i] * diff).normalized();
-            // std::cout << angle_[i].coeffs().transpose() << std::endl;
-            // std::cout << angle_[i+1].coeffs().transpose() << std::endl << std::flush;
-        }
-    }
-    else if (integer_frame < angle_.begin()->first)
+    // Angular velocity is zero after the data, the orientation stays at the last one.
+    if (integer_frame + 1 >= (int)angle_.size())
     {
-        assert(integer_frame >= 0);
-        for (int i = angle_.begin()->first - 1; integer_frame <= i; --i)
-        {
-            Eigen::Quaterniond diff = angular_velocity_->getAngularVelocity(i); //Vector2Quaternion<double>(angular_velocity_->data.row(i).transpose() * angular_velocity_->getInterval());
-            angle_[i] = (angle_[i + 1] * diff.conjugate()).normalized();
-        }
+        return angle_.back();
     }
     // Return slerped quaternion.
     return angle_[integer_frame].slerp(frame - integer_frame, angle_[integer_frame + 1]);
 }
 
-double AngularVelocity::convertEstimatedToMeasuredAngularVelocityFrame(double estimated_angular_velocity_frame, std::vector<std::pair<int32_t,double>> &sync_table){
- //テーブルから所望のaとbの値の計算
-    auto result = std::find_if_not(sync_table.begin(),sync_table.end(),[estimated_angular_velocity_frame](std::pair<int32_t,double> x){return x.first > (int32_t) estimated_angular_velocity_frame;});
-    
-    int32_t x;
-    int32_t x1;
-    double y;
-    double y1;
-
-    // Previous section of sync_table
-    if(sync_table.end() == result)
-    {
-        x = sync_table[0].first;
-        x1 = sync_table[1].first;
-        y = sync_table[0].second;
-        y1 = sync_table[1].second;
-    }else{
-        x = result->first;
-        x1 = (result+1)->first;
-        y = result->second;
-        y1 = (result+1)->second;
-    }
-
-
-    double a = (y1-y)/(x1-x);
-    double b = (y*x1-x*y1)/(x1-x);
-
-    // printf("table position:%ld a:%f b:%f\r\n",(std::distance(sync_table.begin(),result) == (int)sync_table.size() ? -1 : std::distance(sync_table.begin(),result)),a,b);
-
+double AngularVelocity::convertEstimatedToMeasuredAngularVelocityFrame(double estimated_angular_velocity_frame, const SyncTable &sync_table){
+    return sync_table(estimated_angular_velocity_frame);
+}
 
+SyncTable::SyncTable(std::vector<std::pair<int32_t, double>> table) : table_(std::move(table))
+{
+    if (table_.size() < 2)
+    {
+        std::cerr << "Sync table needs two points at least." << std::endl << std::flush;
+        throw "Sync table needs two points at least.";
+    }
+    std::sort(table_.begin(), table_.end());
+    for (size_t i = 0; i + 1 < table_.size(); ++i)
+    {
+        //テーブルから所望のaとbの値の計算
+        int32_t x = table_[i].first;
+        int32_t x1 = table_[i + 1].first;
+        double y = table_[i].second;
+        double y1 = table_[i + 1].second;
+        a_.push_back((y1 - y) / (x1 - x));
+        b_.push_back((y * x1 - x * y1) / (x1 - x));
+    }
+}
 
+/**
+ * @brief Index of the segment that contains the frame.
+ * @details Rows and frames are usually requested in increasing order, so that the segment of the previous
+ * call and the next one are tried first. Otherwise the segment is found by binary search.
+ **/
+size_t SyncTable::findSegment(double estimated_angular_velocity_frame) const
+{
+    const size_t segments = a_.size();
+    // Shared by all tables of the thread, so that it's only a hint.
+    static thread_local size_t cursor = 0;
+    auto contains = [&](size_t i) {
+        return ((0 == i) || (table_[i].first <= estimated_angular_velocity_frame)) &&
+               ((segments - 1 == i) || (estimated_angular_velocity_frame < table_[i + 1].first));
+    };
+    if (cursor < segments)
+    {
+        if (contains(cursor))
+        {
+            return cursor;
+        }
+        if ((cursor + 1 < segments) && contains(cursor + 1))
+        {
+            return ++cursor;
+        }
+    }
+    // The first point whose frame is larger, the segment begins at the point before it.
+    auto it = std::upper_bound(table_.begin() + 1, table_.end() - 1, estimated_angular_velocity_frame,
+                               [](double frame, const std::pair<int32_t, double> &point) { return frame < point.first; });
+    cursor = std::distance(table_.begin(), it) - 1;
+    return cursor;
+}
 
-    //aとbからmeasured_angular_velocityのframeの計算
-    return a * estimated_angular_velocity_frame + b;
+double SyncTable::operator()(double estimated_angular_velocity_frame) const
+{
+    size_t i = findSegment(estimated_angular_velocity_frame);
+    return a_[i] * estimated_angular_velocity_frame + b_[i];
+}
 
+const std::vector<std::pair<int32_t, double>> &SyncTable::getTable() const
+{
+    return table_;
 }
 
 Eigen::Quaterniond AngularVelocity::getCorrectionQuaternionFromFrame(   double estimated_angular_velocity_frame, 
                                                                         const Eigen::VectorXd &filter_coeff,
-                                                                        std::vector<std::pair<int32_t,double>> &sync_table){
+                                                                        const SyncTable &sync_table){
     
     double frame = convertEstimatedToMeasuredAngularVelocityFrame(estimated_angular_velocity_frame, sync_table);
 
@@ -250,16 +307,39 @@ Eigen::Quaterniond AngularVelocity::getCorrectionQuaternionFromFrame(   double e
         double ratio = frame - floor(frame);
         // std::cout << "ratio:" << ratio << std::endl;
         // std::cout << "frame:" << frame << std::endl;
-        Eigen::MatrixXd first  = getRelativeAngle(integer_frame,filter_coeff.rows());
-        Eigen::MatrixXd second = getRelativeAngle(integer_frame+1,filter_coeff.rows());
+        Eigen::Vector3d first  = getFilteredAngle(integer_frame,filter_coeff);
+        Eigen::Vector3d second = getFilteredAngle(integer_frame+1,filter_coeff);
         // std::cout << "first:\r\n" << first << std::endl;
         // std::cout << "second:\r\n" << second << std::endl;
-        // std::cout << "filter_coeff\r\n" << filter_coeff << std::endl;
-        // std::cout << "first:\r\n" << first.transpose() * filter_coeff << std::endl;
-        // std::cout << "second:\r\n" << second.transpose() * filter_coeff << std::endl;
         
 
-        return Vector2Quaternion<double>(first.transpose() *  filter_coeff * (1.0 - ratio) + second.transpose() * filter_coeff * ratio).conjugate();
+        return Vector2Quaternion<double>(first * (1.0 - ratio) + second * ratio).conjugate();
+    }
+}
+
+Eigen::Quaterniond AngularVelocity::getCorrectionQuaternionFromFrame(   double estimated_angular_velocity_frame,
+                                                                        Filter &filter,
+                                                                        int32_t filter_strength,
+                                                                        const SyncTable &sync_table){
+    if (!filter.isRecursive(filter_strength))
+    {
+        return getCorrectionQuaternionFromFrame(estimated_angular_velocity_frame, filter.getFilterCoefficient(filter_strength), sync_table);
+    }
+
+    double frame = convertEstimatedToMeasuredAngularVelocityFrame(estimated_angular_velocity_frame, sync_table);
+    size_t integer_frame = floor(frame);
+
+    if ((frame < 0) || (frame >= data.rows()))
+    {
+        std::cerr << "Waring: Frame range is out of range." << std::endl;
+        return Eigen::Quaterniond(1., 0., 0., 0.);
+    }
+    else
+    {
+        double ratio = frame - floor(frame);
+        Eigen::Vector3d first  = getFilteredAngle(integer_frame,filter,filter_strength);
+        Eigen::Vector3d second = getFilteredAngle(integer_frame+1,filter,filter_strength);
+        return Vector2Quaternion<double>(first * (1.0 - ratio) + second * ratio).conjugate();
     }
 }
 
@@ -282,61 +362,378 @@ Eigen::Quaterniond AngularVelocity::getCorrectionQuaternion(double time, const E
         double ratio = frame - floor(frame);
         // std::cout << "ratio:" << ratio << std::endl;
         // std::cout << "frame:" << frame << std::endl;
-        Eigen::MatrixXd first  = getRelativeAngle(integer_frame,filter_coeff.rows());
-        Eigen::MatrixXd second = getRelativeAngle(integer_frame+1,filter_coeff.rows());
+        Eigen::Vector3d first  = getFilteredAngle(integer_frame,filter_coeff);
+        Eigen::Vector3d second = getFilteredAngle(integer_frame+1,filter_coeff);
         // std::cout << "first:\r\n" << first << std::endl;
         // std::cout << "second:\r\n" << second << std::endl;
-        // std::cout << "filter_coeff\r\n" << filter_coeff << std::endl;
-        // std::cout << "first:\r\n" << first.transpose() * filter_coeff << std::endl;
-        // std::cout << "second:\r\n" << second.transpose() * filter_coeff << std::endl;
         
 
-        return Vector2Quaternion<double>(first.transpose() *  filter_coeff * (1.0 - ratio) + second.transpose() * filter_coeff * ratio).conjugate();
+        return Vector2Quaternion<double>(first * (1.0 - ratio) + second * ratio).conjugate();
     }
 
 }
 
-const Eigen::MatrixXd &AngularVelocity::getRelativeAngle(size_t frame, int length)
+/**
+ * @brief Rotations of every frames, converted from angular velocities in a batch.
+ **/
+const Eigen::MatrixX4d &AngularVelocity::getIncrements()
+{
+    std::lock_guard<std::mutex> lock(increment_mutex);
+    if (increments.rows() != data.rows())
+    {
+        increments.resize(data.rows(), 4);
+        Vectors2Quaternions(data * getInterval(), increments);
+    }
+    return increments;
+}
+
+/**
+ * @brief Relative angles of the window around a frame, as a length x 3 matrix.
+ * @details It is written to the buffer of the caller, so that a loop over frames doesn't allocate per frame.
+ **/
+void AngularVelocity::getRelativeAngle(size_t frame, int length, Eigen::MatrixXd &rotation_vector)
 {
     // Read the angle from a buffer if available.
-    if (relative_angle_vectors.count(frame))
     {
-        if (relative_angle_vectors[frame].rows() != length)
+        std::lock_guard<std::mutex> lock(relative_angle_mutex);
+        if (length * 3 > relative_angle_cache.rows())
         {
-            relative_angle_vectors.erase(frame);
+            // Slots cover some chunks of getFilteredAngle() from several threads, within the memory budget.
+            const size_t budget = 32 * 1024 * 1024 / (sizeof(double) * 3 * length);
+            size_t slots = 256;
+            while ((slots < 4096) && (slots * 2 <= budget))
+            {
+                slots *= 2;
+            }
+            relative_angle_cache.resize(length * 3, slots);
+            relative_angle_tags.assign(slots, std::make_pair(std::numeric_limits<size_t>::max(), 0));
         }
-        else
+        const size_t slot = frame % relative_angle_tags.size();
+        if (relative_angle_tags[slot] == std::make_pair(frame, length))
         {
-            return relative_angle_vectors[frame];
+            rotation_vector = Eigen::Map<const Eigen::MatrixXd>(relative_angle_cache.col(slot).data(), length, 3);
+            return;
         }
     }
 
     // It is not available, create it.
+    const Eigen::MatrixX4d &increment_coeffs = getIncrements();
+    auto increment = [&](size_t frame_position) {
+        // Out of the data, angular velocity is zero.
+        return (frame_position < (size_t)increment_coeffs.rows()) ? Eigen::Quaterniond(increment_coeffs.row(frame_position).transpose()) : Eigen::Quaterniond(1., 0., 0., 0.);
+    };
     Eigen::Quaterniond diff_rotation(1., 0., 0., 0.);
-    Eigen::MatrixXd rotation_vector = Eigen::MatrixXd::Zero(length, 3);
+    rotation_vector.setZero(length, 3);
     size_t center = length / 2;
     size_t r = center + 1;
     for (size_t frame_position = frame + 1; length + frame - center > frame_position; ++r, ++frame_position)
     {
-        diff_rotation = (diff_rotation * Vector2Quaternion<double>(getAngularVelocityVector(frame_position))).normalized();
+        diff_rotation = (diff_rotation * increment(frame_position)).normalized();
         rotation_vector.row(frame_position - frame + center) = Quaternion2Vector(diff_rotation,rotation_vector.row(frame_position - frame + center -1));
     }
 
     // r = center - 1;
     diff_rotation = Eigen::Quaterniond(1., 0., 0., 0.);
-    for (size_t frame_position = frame - 1; frame - center <= frame_position; --frame_position)
+    // Windows reaching before the first frame keep zeros in the backward half.
+    // The loop counts down to frame - center without wrapping around zero.
+    if (frame >= center)
     {
-        diff_rotation = (diff_rotation * Vector2Quaternion<double>(getAngularVelocityVector(frame_position)).conjugate()).normalized();
-        rotation_vector.row(frame_position - frame + center) = Quaternion2Vector(diff_rotation,rotation_vector.row(frame_position - frame + center + 1));
+        for (size_t frame_position = frame; frame_position-- > frame - center;)
+        {
+            diff_rotation = (diff_rotation * increment(frame_position).conjugate()).normalized();
+            rotation_vector.row(frame_position - frame + center) = Quaternion2Vector(diff_rotation,rotation_vector.row(frame_position - frame + center + 1));
+        }
     }
     // std::cout << "rotation_vector:\r\n" << rotation_vector << std::endl;
-    relative_angle_vectors[frame] = rotation_vector;
-    return relative_angle_vectors[frame];
+    // The vectors are made out of the lock. Another thread may have made the same one, which is identical.
+    std::lock_guard<std::mutex> lock(relative_angle_mutex);
+    if (length * 3 <= relative_angle_cache.rows())
+    {
+        const size_t slot = frame % relative_angle_tags.size();
+        Eigen::Map<Eigen::MatrixXd>(relative_angle_cache.col(slot).data(), length, 3) = rotation_vector;
+        relative_angle_tags[slot] = std::make_pair(frame, length);
+    }
+}
+
+
+
+
+
+/**
+ * @brief Chunk of the key, or nullptr if it isn't cached. filtered_angle_mutex must be locked.
+ **/
+const std::vector<Eigen::Vector3d> *AngularVelocity::findFilteredChunk(const FilteredKey &key)
+{
+    auto it = filtered_chunks.find(key);
+    if (filtered_chunks.end() == it)
+    {
+        return nullptr;
+    }
+    filtered_chunk_order.splice(filtered_chunk_order.begin(), filtered_chunk_order, it->second.order);
+    return &it->second.angle;
+}
+
+/**
+ * @brief Cache a chunk, and drop the least recently used chunks beyond 64 MB. filtered_angle_mutex must be locked.
+ **/
+void AngularVelocity::addFilteredChunk(const FilteredKey &key, std::vector<Eigen::Vector3d> &angle)
+{
+    const size_t budget = 64 * 1024 * 1024;
+    if (filtered_chunks.count(key))
+    {
+        return;
+    }
+    filtered_chunk_order.push_front(key);
+    FilteredChunk &chunk = filtered_chunks[key];
+    chunk.angle.swap(angle);
+    chunk.order = filtered_chunk_order.begin();
+    filtered_chunk_bytes += chunk.angle.size() * sizeof(Eigen::Vector3d);
+    while ((filtered_chunk_bytes > budget) && (filtered_chunk_order.size() > 1))
+    {
+        auto oldest = filtered_chunks.find(filtered_chunk_order.back());
+        filtered_chunk_bytes -= oldest->second.angle.size() * sizeof(Eigen::Vector3d);
+        filtered_chunks.erase(oldest);
+        filtered_chunk_order.pop_back();
+    }
+}
+
+/**
+ * @brief Drop the chunks from first to last, both inclusive. filtered_angle_mutex must be locked.
+ **/
+void AngularVelocity::eraseFilteredChunks(const FilteredKey &first, const FilteredKey &last)
+{
+    auto it = filtered_chunks.lower_bound(first);
+    auto end = filtered_chunks.upper_bound(last);
+    while (it != end)
+    {
+        filtered_chunk_bytes -= it->second.angle.size() * sizeof(Eigen::Vector3d);
+        filtered_chunk_order.erase(it->second.order);
+        it = filtered_chunks.erase(it);
+    }
+}
+
+/**
+ * @brief Drop the chunks of the length if they were filtered with other taps. filtered_angle_mutex must be locked.
+ **/
+void AngularVelocity::checkFilterTaps(const Eigen::VectorXd &filter_coeff)
+{
+    const int length = filter_coeff.rows();
+    auto &taps = filter_taps[length];
+    if ((taps.first != filter_coeff.data()) || (taps.second.rows() != length))
+    {
+        if ((taps.second.rows() != length) || (taps.second != filter_coeff))
+        {
+            taps.second = filter_coeff;
+            eraseFilteredChunks(FilteredKey(nullptr, length, 0), FilteredKey(nullptr, length, std::numeric_limits<size_t>::max()));
+        }
+        taps.first = filter_coeff.data();
+    }
 }
 
+/**
+ * @brief Relative angles of the window around a frame, filtered with the coefficients.
+ * @details The value of a frame doesn't change once calculated. Frames are calculated by chunks when they are
+ * requested first, after that it costs a lookup while the chunk stays in the cache.
+ **/
+Eigen::Vector3d AngularVelocity::getFilteredAngle(size_t frame, const Eigen::VectorXd &filter_coeff)
+{
+    const size_t chunk_size = 256;
+    const int length = filter_coeff.rows();
+    const size_t frames = data.rows() + 1;
+    Eigen::MatrixXd relative_angle(length, 3);
+    if (frame >= frames)
+    {
+        getRelativeAngle(frame, length, relative_angle);
+        return relative_angle.transpose() * filter_coeff;
+    }
+    const size_t chunk = frame / chunk_size;
+    const FilteredKey key(nullptr, length, chunk);
+    {
+        std::lock_guard<std::mutex> lock(filtered_angle_mutex);
+        checkFilterTaps(filter_coeff);
+        const std::vector<Eigen::Vector3d> *cached = findFilteredChunk(key);
+        if (cached)
+        {
+            return (*cached)[frame - chunk * chunk_size];
+        }
+    }
+
+    // Calculate the chunk out of the lock. Another thread may calculate the same one, which is identical.
+    size_t begin = chunk * chunk_size;
+    size_t end = std::min(begin + chunk_size, frames);
+    std::vector<Eigen::Vector3d> angle(end - begin);
+    for (size_t i = begin; i < end; ++i)
+    {
+        getRelativeAngle(i, length, relative_angle);
+        angle[i - begin] = relative_angle.transpose() * filter_coeff;
+    }
+    Eigen::Vector3d retval = angle[frame - begin];
+
+    std::lock_guard<std::mutex> lock(filtered_angle_mutex);
+    checkFilterTaps(filter_coeff);
+    addFilteredChunk(key, angle);
+    return retval;
+}
+
+/**
+ * @brief Angular velocity integrated over the whole data, by the trapezoidal rule.
+ * @details The backward half of the window in getRelativeAngle() is one frame behind the forward half.
+ * Trapezoidal integration centers the trajectory between them.
+ **/
+const std::vector<Eigen::Vector3d> &AngularVelocity::getTrajectory()
+{
+    std::lock_guard<std::mutex> lock(trajectory_mutex);
+    const size_t length = data.rows() + 1;
+    if (trajectory.size() != length)
+    {
+        trajectory.resize(length);
+        trajectory[0] = getAngularVelocityVector((size_t)0) * 0.5;
+        for (size_t n = 1; n < length; ++n)
+        {
+            trajectory[n] = trajectory[n - 1] + (getAngularVelocityVector(n - 1) + getAngularVelocityVector(n)) * 0.5;
+        }
+    }
+    return trajectory;
+}
+
+/**
+ * @brief Filtered angle of a frame with a recursive filter.
+ * @details The trajectory is filtered forward and backward over the whole data once per strength. States of the
+ * recursion at the boundaries of chunks are cached as the last chunk of the strength, so that a chunk dropped from
+ * the cache is filtered again from them exactly as the whole pass did. Either way it costs O(1) per frame.
+ * Out of the data the trajectory stays at the angle of the edge. The forward pass starts from its steady state,
+ * the backward pass from the state of the forward pass by the boundary matrix of the coefficients.
+ * The angle is the difference between the filtered and the original trajectory.
+ **/
+Eigen::Vector3d AngularVelocity::getFilteredAngle(size_t frame, Filter &filter, int32_t filter_strength)
+{
+    const size_t chunk_size = 256;
+    const std::vector<Eigen::Vector3d> &angle = getTrajectory();
+    const size_t length = angle.size();
+    if (frame >= length)
+    {
+        return Eigen::Vector3d::Zero();
+    }
+    const size_t chunk = frame / chunk_size;
+    const size_t begin = chunk * chunk_size;
+    const size_t end = std::min(begin + chunk_size, length);
+    const FilteredKey key(&filter, filter_strength, chunk);
+    const FilteredKey state_key(&filter, filter_strength, std::numeric_limits<size_t>::max());
+    // Forward states (y[begin-1], y[begin-2], y[begin-3]) and backward states (z[end], z[end+1], z[end+2]) of every chunk.
+    std::vector<Eigen::Vector3d> states;
+    {
+        std::lock_guard<std::mutex> lock(filtered_angle_mutex);
+        const std::vector<Eigen::Vector3d> *cached = findFilteredChunk(key);
+        if (cached)
+        {
+            return (*cached)[frame - begin];
+        }
+        cached = findFilteredChunk(state_key);
+        if (cached)
+        {
+            states.assign(cached->begin() + chunk * 6, cached->begin() + chunk * 6 + 6);
+        }
+    }
 
+    // Filter out of the lock. Another thread may filter the same one, which is identical.
+    const Eigen::VectorXd &coeff = filter.getFilterCoefficient(filter_strength);
+    auto step = [&](const Eigen::Vector3d &x, Eigen::Vector3d *w) {
+        Eigen::Vector3d y = coeff[0] * x + coeff[1] * w[0] + coeff[2] * w[1] + coeff[3] * w[2];
+        w[2] = w[1];
+        w[1] = w[0];
+        w[0] = y;
+        return y;
+    };
+    std::vector<Eigen::Vector3d> result(end - begin);
+    Eigen::Vector3d w[3];
+    if (states.empty())
+    {
+        std::vector<Eigen::Vector3d> all_states((length + chunk_size - 1) / chunk_size * 6);
+        std::vector<Eigen::Vector3d> filtered(length);
+        w[0] = w[1] = w[2] = angle[0];
+        for (size_t n = 0; n < length; ++n)
+        {
+            if (0 == n % chunk_size)
+            {
+                std::copy(w, w + 3, all_states.begin() + n / chunk_size * 6);
+            }
+            filtered[n] = step(angle[n], w);
+        }
+        const Eigen::Vector3d &last = angle[length - 1];
+        Eigen::Vector3d v[3];
+        for (int k = 0; k < 3; ++k)
+        {
+            v[k] = last;
+            for (int j = 0; j < 3; ++j)
+            {
+                v[k] += coeff[4 + k * 3 + j] * (w[j] - last);
+            }
+        }
+        for (size_t n = length; n-- > 0;)
+        {
+            if ((length == n + 1) || (0 == (n + 1) % chunk_size))
+            {
+                std::copy(v, v + 3, all_states.begin() + n / chunk_size * 6 + 3);
+            }
+            filtered[n] = step(filtered[n], v);
+        }
+        for (size_t n = begin; n < end; ++n)
+        {
+            result[n - begin] = filtered[n] - angle[n];
+        }
+        states.swap(all_states);
+    }
+    else
+    {
+        std::copy(states.begin(), states.begin() + 3, w);
+        for (size_t n = begin; n < end; ++n)
+        {
+            result[n - begin] = step(angle[n], w);
+        }
+        std::copy(states.begin() + 3, states.end(), w);
+        for (size_t n = end; n-- > begin;)
+        {
+            result[n - begin] = step(result[n - begin], w) - angle[n];
+        }
+        states.clear();
+    }
+    Eigen::Vector3d retval = result[frame - begin];
 
+    std::lock_guard<std::mutex> lock(filtered_angle_mutex);
+    if (!states.empty())
+    {
+        addFilteredChunk(state_key, states);
+    }
+    addFilteredChunk(key, result);
+    return retval;
+}
 
+/**
+ * @brief Relative RMS deviation of the angles filtered by a recursive filter from the gaussian taps.
+ * @details Frames are sampled evenly over the data, a half length away from the ends, where the taps cut the window.
+ * Returns zero if the filter uses the taps at the strength.
+ **/
+double AngularVelocity::getRecursiveFilterDeviation(Filter &filter, int32_t filter_strength, size_t samples)
+{
+    const size_t margin = filter_strength;
+    if (!filter.isRecursive(filter_strength) || (0 == samples) || ((size_t)data.rows() <= 2 * margin))
+    {
+        return 0.0;
+    }
+    NormalDistributionFilter gaussian;
+    const Eigen::VectorXd &taps = gaussian.getFilterCoefficient(filter_strength);
+    double error = 0.0, norm = 0.0;
+    Eigen::MatrixXd relative_angle(taps.rows(), 3);
+    for (size_t i = 0; i < samples; ++i)
+    {
+        size_t frame = margin + (2 * i + 1) * (data.rows() - 2 * margin) / (2 * samples);
+        getRelativeAngle(frame, taps.rows(), relative_angle);
+        Eigen::Vector3d reference = relative_angle.transpose() * taps;
+        error += (getFilteredAngle(frame, filter, filter_strength) - reference).squaredNorm();
+        norm += reference.squaredNorm();
+    }
+    return (norm > 0.0) ? sqrt(error / norm) : 0.0;
+}
 
 NormalDistributionFilter::NormalDistributionFilter(){
     // Do nothing.
@@ -348,6 +745,7 @@ void NormalDistributionFilter::setFilterCoefficient(int32_t half_length){
         throw;
     }
 
+    std::lock_guard<std::mutex> lock(filter_coefficients_mutex_);
     half_length_ = half_length;
     if(filter_coefficients_.count(half_length)){
         return;
@@ -373,10 +771,172 @@ void NormalDistributionFilter::setFilterCoefficient(int32_t half_length){
 
 const Eigen::VectorXd &NormalDistributionFilter::getFilterCoefficient(int32_t half_length){
     setFilterCoefficient(half_length);
+    // Elements of std::map never move, so that the reference stays valid while other coefficients are added.
+    std::lock_guard<std::mutex> lock(filter_coefficients_mutex_);
     return filter_coefficients_[half_length];
 }
 
 NormalDistributionFilter &NormalDistributionFilter::operator()(int32_t half_length){
     setFilterCoefficient(half_length);
     return *this;
-}
\ No newline at end of file
+}
+
+RecursiveGaussianFilter::RecursiveGaussianFilter(){
+    // Do nothing.
+}
+
+/**
+ * @brief Recursion coefficients (a1, a2, a3) of a real pole and a pair of complex poles.
+ * @param shape Decay of the real pole, decay and angle of the complex poles, per sigma.
+ **/
+static Eigen::Vector3d getRecursionCoefficients(const Eigen::Vector3d &shape, double sigma)
+{
+    double r0 = exp(-shape[0] / sigma);
+    double r = exp(-shape[1] / sigma);
+    double theta = shape[2] / sigma;
+    return Eigen::Vector3d(r0 + 2.0 * r * cos(theta), -(2.0 * r0 * r * cos(theta) + r * r), r0 * r * r);
+}
+
+/**
+ * @brief Minimize a function of 3 variables by Nelder - Mead method.
+ **/
+static Eigen::Vector3d minimize(std::function<double(const Eigen::Vector3d &)> cost, const Eigen::Vector3d &initial, double step, int iterations)
+{
+    std::vector<std::pair<double, Eigen::Vector3d>> simplex;
+    simplex.emplace_back(cost(initial), initial);
+    for (int i = 0; i < 3; ++i)
+    {
+        Eigen::Vector3d x = initial;
+        x[i] += step;
+        simplex.emplace_back(cost(x), x);
+    }
+    auto less = [](const std::pair<double, Eigen::Vector3d> &a, const std::pair<double, Eigen::Vector3d> &b) { return a.first < b.first; };
+    for (int iteration = 0; iteration < iterations; ++iteration)
+    {
+        std::sort(simplex.begin(), simplex.end(), less);
+        Eigen::Vector3d centroid = (simplex[0].second + simplex[1].second + simplex[2].second) / 3.0;
+        Eigen::Vector3d reflected = 2.0 * centroid - simplex[3].second;
+        double reflected_cost = cost(reflected);
+        if (reflected_cost < simplex[0].first)
+        {
+            Eigen::Vector3d expanded = 3.0 * centroid - 2.0 * simplex[3].second;
+            double expanded_cost = cost(expanded);
+            simplex[3] = (expanded_cost < reflected_cost) ? std::make_pair(expanded_cost, expanded) : std::make_pair(reflected_cost, reflected);
+        }
+        else if (reflected_cost < simplex[2].first)
+        {
+            simplex[3] = std::make_pair(reflected_cost, reflected);
+        }
+        else
+        {
+            Eigen::Vector3d contracted = 0.5 * (centroid + simplex[3].second);
+            double contracted_cost = cost(contracted);
+            if (contracted_cost < simplex[3].first)
+            {
+                simplex[3] = std::make_pair(contracted_cost, contracted);
+            }
+            else
+            {
+                for (int i = 1; i < 4; ++i)
+                {
+                    simplex[i].second = 0.5 * (simplex[0].second + simplex[i].second);
+                    simplex[i].first = cost(simplex[i].second);
+                }
+            }
+        }
+    }
+    return std::min_element(simplex.begin(), simplex.end(), less)->second;
+}
+
+/**
+ * @brief Coefficients of the recursive filter fitted to NormalDistributionFilter of the half length.
+ * @details Coefficients are (B, a1, a2, a3) of y[n] = B x[n] + a1 y[n-1] + a2 y[n-2] + a3 y[n-3], and the boundary
+ * matrix M of Triggs - Sdika in row major order. The backward pass starts from
+ * z[N+k] = x[N-1] + sum_j M(k,j) (y[N-1-j] - x[N-1]), which continues the data with its last value.
+ *
+ * Poles are fitted to the correction of the taps as getRelativeAngle() applies them. The backward half of its window
+ * is one frame behind, so that the correction is sum_i C_i (w[f+i] - w[f-i]) of angles w of every frame, where C_i is
+ * the sum of the taps from i to the half length. On the trapezoidal trajectory of getTrajectory() it is a zero phase
+ * filter of gain G(omega) = 1 - 4 tan(omega/2) sum_i C_i sin(omega i). The squared gain of the recursion is fitted to it,
+ * weighted by the power of a random walk, by Nelder - Mead method starting from the poles of a large half length.
+ * It takes a few milliseconds per half length.
+ **/
+void RecursiveGaussianFilter::setFilterCoefficient(int32_t half_length){
+    if(half_length < 0){
+        std::cerr << "half length should be larger than zero." << std::endl << std::flush;
+        throw;
+    }
+    {
+        std::lock_guard<std::mutex> lock(filter_coefficients_mutex_);
+        half_length_ = half_length;
+        if(filter_coefficients_.count(half_length)){
+            return;
+        }
+    }
+
+    // Fit out of the lock. Another thread may fit the same one, which is identical.
+    Eigen::VectorXd coeff = Eigen::VectorXd::Zero(13);
+    coeff[0] = 1.0;
+    if(0 < half_length){
+        NormalDistributionFilter gaussian;
+        const Eigen::VectorXd &taps = gaussian.getFilterCoefficient(half_length);
+        Eigen::VectorXd tail(half_length + 1); // C_i
+        tail[half_length] = taps[2 * half_length];
+        for(int32_t i = half_length - 1; i >= 0; --i){
+            tail[i] = tail[i + 1] + taps[half_length + i];
+        }
+
+        const double sigma = half_length / (3.0 * sqrt(2.0));
+        const int points = 512;
+        const double band = std::min(M_PI, 10.0 / sigma); // The gain is flat out of it.
+        Eigen::ArrayXd omega = (Eigen::ArrayXd::LinSpaced(points, 0, points - 1) + 0.5) * (band / points);
+        Eigen::ArrayXd target = Eigen::ArrayXd::Ones(points);
+        for(int32_t i = 1; i <= half_length; ++i){
+            target -= 4.0 * tail[i] * (omega * 0.5).tan() * (omega * i).sin();
+        }
+        Eigen::ArrayXd weight = (omega * 0.5).tan().square().inverse();
+        const double norm = ((1.0 - target).square() * weight).sum();
+        auto cost = [&](const Eigen::Vector3d &shape) {
+            if((shape.minCoeff() <= 0.0) || (shape[2] >= M_PI * sigma)){
+                return std::numeric_limits<double>::max();
+            }
+            Eigen::Vector3d a = getRecursionCoefficients(shape, sigma);
+            Eigen::ArrayXd re = 1.0 - a[0] * omega.cos() - a[1] * (2.0 * omega).cos() - a[2] * (3.0 * omega).cos();
+            Eigen::ArrayXd im = a[0] * omega.sin() + a[1] * (2.0 * omega).sin() + a[2] * (3.0 * omega).sin();
+            Eigen::ArrayXd gain = std::pow(1.0 - a.sum(), 2.0) / (re.square() + im.square());
+            return ((gain - target).square() * weight).sum() / norm;
+        };
+        Eigen::Vector3d a = getRecursionCoefficients(minimize(cost, Eigen::Vector3d(1.31, 1.19, 1.30), 0.05, 200), sigma);
+        coeff[0] = 1.0 - a.sum();
+        coeff.segment<3>(1) = a;
+
+        // Response to deviations of the last 3 outputs of the forward pass, until it decays.
+        const int32_t decay = 40.0 * sigma + 64;
+        std::vector<double> e(decay + 3), d(decay + 3);
+        for(int j = 0; j < 3; ++j){
+            std::fill(e.begin(), e.end(), 0.0);
+            std::fill(d.begin(), d.end(), 0.0);
+            e[2 - j] = 1.0; // e[0], e[1], e[2] are y[N-3], y[N-2], y[N-1].
+            for(int32_t n = 3; n < decay + 3; ++n){
+                e[n] = a[0] * e[n - 1] + a[1] * e[n - 2] + a[2] * e[n - 3];
+            }
+            for(int32_t n = decay + 2; n >= 3; --n){
+                d[n] = coeff[0] * e[n] + ((n + 1 < decay + 3) ? a[0] * d[n + 1] : 0.0) + ((n + 2 < decay + 3) ? a[1] * d[n + 2] : 0.0) +
+                       ((n + 3 < decay + 3) ? a[2] * d[n + 3] : 0.0);
+            }
+            for(int k = 0; k < 3; ++k){
+                coeff[4 + k * 3 + j] = d[3 + k];
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(filter_coefficients_mutex_);
+    if(!filter_coefficients_.count(half_length)){
+        filter_coefficients_[half_length] = coeff;
+    }
+}
+
+RecursiveGaussianFilter &RecursiveGaussianFilter::operator()(int32_t half_length){
+    setFilterCoefficient(half_length);
+    return *this;
+}
@@ -0,0 +1,287 @@
+/*************************************************************************
+*  Software License Agreement (BSD 3-Clause License)
+*  
+*  Copyright (c) 2019, Yoshiaki Sato
+*  All rights reserved.
+*  
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions are met:
+*  
+*  1. Redistributions of source code must retain the above copyright notice, this
+*     list of conditions and the following disclaimer.
+*  
+*  2. Redistributions in binary form must reproduce the above copyright notice,
+*     this list of conditions and the following disclaimer in the documentation
+*     and/or other materials provided with the distribution.
+*  
+*  3. Neither the name of the copyright holder nor the names of its
+*     contributors may be used to endorse or promote products derived from
+*     this software without specific prior written permission.
+*  
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+*  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+*  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+*  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+*  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+*  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+*  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*************************************************************************/
+#include "thread_pool.h"
+#include <algorithm>
+#include <iostream>
+
+size_t ThreadPool::concurrency_ = 0;
+
+// Index of the worker running on this thread, -1 out of the pool.
+static thread_local int32_t worker_index = -1;
+
+/**
+ * @brief Set the number of workers. 0 uses all cores.
+ **/
+void ThreadPool::setConcurrency(size_t threads)
+{
+    concurrency_ = threads;
+}
+
+ThreadPool &ThreadPool::getInstance()
+{
+    static ThreadPool pool(concurrency_ ? concurrency_ : std::max(1u, std::thread::hardware_concurrency()));
+    if (concurrency_ && (concurrency_ != pool.getConcurrency()))
+    {
+        std::cerr << "Warning: Thread pool is already running with " << pool.getConcurrency() << " threads." << std::endl;
+        concurrency_ = pool.getConcurrency();
+    }
+    return pool;
+}
+
+ThreadPool::ThreadPool(size_t threads) : pending_(0), next_queue_(0), is_running_(true)
+{
+    for (size_t i = 0; i < threads; ++i)
+    {
+        queues_.emplace_back(new Queue);
+    }
+    for (size_t i = 0; i < threads; ++i)
+    {
+        workers_.emplace_back(&ThreadPool::process, this, (int32_t)i);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+        is_running_ = false;
+    }
+    wake_.notify_all();
+    for (auto &worker : workers_)
+    {
+        worker.join();
+    }
+}
+
+size_t ThreadPool::getConcurrency() const
+{
+    return workers_.size();
+}
+
+/**
+ * @brief Queue a task. A task submitted by a worker goes to the queue of the worker.
+ **/
+void ThreadPool::submit(std::function<void()> task, Priority priority)
+{
+    size_t index = (worker_index >= 0) ? (size_t)worker_index : next_queue_++ % queues_.size();
+    {
+        std::lock_guard<std::mutex> lock(queues_[index]->mutex);
+        queues_[index]->tasks[(int)priority].emplace_back(std::move(task));
+    }
+    ++pending_;
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+    }
+    wake_.notify_one();
+}
+
+/**
+ * @brief Run a task of the highest priority, from the own queue first.
+ * @param [in] self Index of the worker, or -1 out of the pool.
+ * @retval false No task was found.
+ **/
+bool ThreadPool::tryRun(int32_t self)
+{
+    const size_t n = queues_.size();
+    for (int priority = 0; priority < 3; ++priority)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            bool own = (self >= 0) && (0 == i);
+            Queue &queue = *queues_[(std::max(self, 0) + i) % n];
+            std::function<void()> task;
+            {
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                std::deque<std::function<void()>> &tasks = queue.tasks[priority];
+                if (tasks.empty())
+                {
+                    continue;
+                }
+                // Own tasks are taken from the back, which is warm in the cache. Stolen tasks from the front.
+                if (own)
+                {
+                    task = std::move(tasks.back());
+                    tasks.pop_back();
+                }
+                else
+                {
+                    task = std::move(tasks.front());
+                    tasks.pop_front();
+                }
+            }
+            --pending_;
+            task();
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::process(int32_t index)
+{
+    worker_index = index;
+    while (1)
+    {
+        if (tryRun(index))
+        {
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleep_mutex_);
+        wake_.wait(lock, [&] { return !is_running_ || (pending_ > 0); });
+        if (!is_running_)
+        {
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Call body(chunk_begin, chunk_end) over [begin, end) split into chunks of grain.
+ * @details Chunks are claimed in order by the workers and the calling thread. The result doesn't depend on
+ * the number of threads as long as body writes only its own chunk. An exception of body is thrown again here.
+ * @param [in] grain Size of a chunk. 0 makes 8 chunks per thread.
+ **/
+void ThreadPool::parallelFor(int32_t begin, int32_t end, const std::function<void(int32_t, int32_t)> &body, Priority priority, int32_t grain)
+{
+    if (end <= begin)
+    {
+        return;
+    }
+    if (grain <= 0)
+    {
+        grain = std::max<int32_t>(1, (end - begin) / (int32_t)(getConcurrency() * 8));
+    }
+    struct State
+    {
+        std::atomic<int32_t> next_chunk;
+        int32_t done_chunks = 0;
+        std::mutex mutex;
+        std::condition_variable finished;
+        std::exception_ptr exception;
+    };
+    auto state = std::make_shared<State>();
+    state->next_chunk = 0;
+    const int32_t chunks = (end - begin + grain - 1) / grain;
+    // Helpers starting after all chunks were claimed return without touching body.
+    const std::function<void(int32_t, int32_t)> *body_ptr = &body;
+    auto run = [state, chunks, begin, end, grain, body_ptr]() {
+        for (int32_t chunk = state->next_chunk++; chunk < chunks; chunk = state->next_chunk++)
+        {
+            std::exception_ptr exception;
+            try
+            {
+                (*body_ptr)(begin + chunk * grain, std::min(end, begin + (chunk + 1) * grain));
+            }
+            catch (...)
+            {
+                exception = std::current_exception();
+            }
+            std::lock_guard<std::mutex> lock(state->mutex);
+            if (exception && !state->exception)
+            {
+                state->exception = exception;
+            }
+            if (chunks == ++state->done_chunks)
+            {
+                state->finished.notify_all();
+            }
+        }
+    };
+    for (int32_t i = 0, e = std::min<int32_t>(chunks - 1, getConcurrency()); i < e; ++i)
+    {
+        submit(run, priority);
+    }
+    run();
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->finished.wait(lock, [&] { return chunks == state->done_chunks; });
+    if (state->exception)
+    {
+        std::rethrow_exception(state->exception);
+    }
+}
+
+ThreadPool::TaskGroup::TaskGroup(Priority priority, size_t max_in_flight) : priority_(priority),
+                                                                           max_in_flight_(max_in_flight ? max_in_flight : ThreadPool::getInstance().getConcurrency() * 2),
+                                                                           state_(std::make_shared<State>())
+{
+}
+
+ThreadPool::TaskGroup::~TaskGroup()
+{
+    // Exceptions are dropped here, call wait() to receive them.
+    std::unique_lock<std::mutex> lock(state_->mutex);
+    state_->done.wait(lock, [&] { return 0 == state_->in_flight; });
+}
+
+void ThreadPool::TaskGroup::submit(std::function<void()> task)
+{
+    {
+        std::unique_lock<std::mutex> lock(state_->mutex);
+        state_->done.wait(lock, [&] { return state_->in_flight < max_in_flight_; });
+        ++state_->in_flight;
+    }
+    std::shared_ptr<State> state = state_;
+    ThreadPool::getInstance().submit([state, task]() {
+        std::exception_ptr exception;
+        try
+        {
+            task();
+        }
+        catch (...)
+        {
+            exception = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if (exception && !state->exception)
+        {
+            state->exception = exception;
+        }
+        --state->in_flight;
+        state->done.notify_all();
+    },
+                                     priority_);
+}
+
+/**
+ * @brief Wait for all tasks of the group.
+ **/
+void ThreadPool::TaskGroup::wait()
+{
+    std::unique_lock<std::mutex> lock(state_->mutex);
+    state_->done.wait(lock, [&] { return 0 == state_->in_flight; });
+    if (state_->exception)
+    {
+        std::exception_ptr exception = state_->exception;
+        state_->exception = nullptr;
+        std::rethrow_exception(exception);
+    }
+}
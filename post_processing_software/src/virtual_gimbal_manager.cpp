@@ -123,24 +123,24 @@ Eigen::VectorXd VirtualGimbalManager::getCorrelationCoefficient(int32_t begin, i
         throw;
     }
     Eigen::VectorXd correlation_coefficients(diff + 1);
-    for (int32_t frame = 0, end = correlation_coefficients.rows(); frame < end; ++frame)
-    {
-        int32_t number_of_data = particial_confidence.cast<int>().array().sum();
-        if (0 == number_of_data)
-        {
-            correlation_coefficients[frame] = std::numeric_limits<double>::max();
-        }
-        else
-        {
-            correlation_coefficients[frame] = ((measured_angular_velocity_resampled.block(frame, 0, particial_estimated_angular_velocity.rows(), particial_estimated_angular_velocity.cols()) - particial_estimated_angular_velocity).array().colwise() * particial_confidence.array()).abs().sum() / (double)number_of_data;
-        }
-
-        if (frame % 100 == 0)
+    const int32_t number_of_data = particial_confidence.cast<int>().array().sum();
+    std::atomic<int32_t> finished_frames(0);
+    ThreadPool::getInstance().parallelFor(0, correlation_coefficients.rows(), [&](int32_t begin, int32_t end) {
+        for (int32_t frame = begin; frame < end; ++frame)
         {
-            printf("\r%d / %d", frame, diff);
-            std::cout << std::flush;
+            if (0 == number_of_data)
+            {
+                correlation_coefficients[frame] = std::numeric_limits<double>::max();
+            }
+            else
+            {
+                correlation_coefficients[frame] = ((measured_angular_velocity_resampled.block(frame, 0, particial_estimated_angular_velocity.rows(), particial_estimated_angular_velocity.cols()) - particial_estimated_angular_velocity).array().colwise() * particial_confidence.array()).abs().sum() / (double)number_of_data;
+            }
         }
-    }
+        int32_t finished = (finished_frames += end - begin);
+        printf("\r%d / %d", finished - 1, diff);
+        std::cout << std::flush;
+    });
     return correlation_coefficients;
 }
 
@@ -231,7 +231,7 @@ Eigen::MatrixXd VirtualGimbalManager::getRotationQuaternions()
 {
     Eigen::MatrixXd data;
     data.resize(estimated_angular_velocity->data.rows(), 4);
-    rotation_quaternion = std::make_shared<RotationQuaternion>(measured_angular_velocity, *resampler_parameter_);
+    rotation_quaternion = std::make_shared<RotationQuaternion>(measured_angular_velocity, *resampler_parameter_, rotation_integrator);
     for (int i = 0, e = data.rows(); i < e; ++i)
     {
 
@@ -466,39 +466,119 @@ void VirtualGimbalManager::setMaximumGradient(double value)
     maximum_gradient_ = value;
 }
 
+/**
+ * @brief Strongest filter strength of every frame which leaves no black space, limited by the maximum gradient.
+ * @details Except with the path solver, frames are searched in parallel in chunks of 16 frames, which are claimed in frame order.
+ * Each chunk depends only on its own search, so that the result is the same for any number of threads.
+ * The path solver sweeps all frames once with an evaluator per thread, findFilterStrengthPath(), whose path is already limited.
+ * Progress and the remaining time are printed while it runs.
+ **/
 Eigen::VectorXd VirtualGimbalManager::getFilterCoefficients(double zoom,
                                                             FilterPtr filter,
-                                                            std::vector<std::pair<int32_t, double>> &sync_table,
+                                                            const SyncTable &sync_table,
                                                             int32_t strongest_filter_param, int32_t weakest_filter_param)
 {
 
     Eigen::VectorXd filter_strength(video_param->video_frames);
-    //Calcurate in all frame
-    for (int frame = 0, e = filter_strength.rows(); frame < e; ++frame)
-    {
-        // double time = resampler_parameter_->start + frame * video_param->getInterval();
-
-        // フィルタが弱くて、簡単な条件で、黒帯が出るなら、しょうが無いからこれを採用
-        if (hasBlackSpace(frame, zoom, measured_angular_velocity, video_param, filter->getFilterCoefficient(weakest_filter_param), sync_table))
+    const int32_t frames = filter_strength.rows();
+    const auto start_time = std::chrono::steady_clock::now();
+    auto last_report = start_time;
+    std::atomic<int32_t> finished_frames(0);
+    std::atomic<size_t> evaluations(0);
+    std::mutex report_mutex;
+    // Reports if no other thread is reporting, twice a second at most.
+    auto report = [&](int32_t finished) {
+        std::unique_lock<std::mutex> lock(report_mutex, std::try_to_lock);
+        auto now = std::chrono::steady_clock::now();
+        if (lock.owns_lock() && (now - last_report > std::chrono::milliseconds(500)))
         {
-            filter_strength[frame] = weakest_filter_param;
-        }
-        // フィルタが強くて、すごく安定化された条件で、難しい条件で、黒帯が出ないなら、喜んでこれを採用
-        else if (!hasBlackSpace(frame, zoom, measured_angular_velocity, video_param, filter->getFilterCoefficient(strongest_filter_param), sync_table))
-        {
-            filter_strength[frame] = strongest_filter_param;
+            double elapsed = std::chrono::duration<double>(now - start_time).count();
+            printf("\rFilter strength: %d / %d frames, %.0f seconds remaining.    ", finished, frames, elapsed * (frames - finished) / finished);
+            std::cout << std::flush;
+            last_report = now;
         }
-        else
+    };
+    // Rays of the contour are undistorted once here, and copied with the buffers by each chunk.
+    const BlackSpaceEvaluator prototype(measured_angular_velocity, video_param, filter, sync_table, zoom);
+    if (FilterStrengthSolver::Path == filter_strength_solver)
+    {
+        std::vector<BlackSpaceEvaluator, Eigen::aligned_allocator<BlackSpaceEvaluator>> evaluators(std::max<size_t>(1, ThreadPool::getInstance().getConcurrency()), prototype);
+        findFilterStrengthPath(evaluators, strongest_filter_param, weakest_filter_param, maximum_gradient_, filter_strength, report);
+        for (const auto &evaluator : evaluators)
         {
-            filter_strength[frame] = bisectionMethod(frame, zoom, measured_angular_velocity, video_param, filter, sync_table, strongest_filter_param, weakest_filter_param);
+            evaluations += evaluator.evaluations;
         }
     }
+    else
+    {
+        //Calcurate in all frame
+        // Frames are independent until gradientLimit(), each chunk writes its own frames.
+        ThreadPool::getInstance().parallelFor(0, frames, [&](int32_t begin, int32_t end) {
+            BlackSpaceEvaluator evaluator(prototype);
+            // The warm started search starts from scratch on every chunk, so that the result doesn't depend on the threads.
+            FilterStrengthSearch search;
+            for (int frame = begin; frame < end; ++frame)
+            {
+                // double time = resampler_parameter_->start + frame * video_param->getInterval();
+                if (FilterStrengthSolver::WarmStart == filter_strength_solver)
+                {
+                    filter_strength[frame] = findFilterStrength(frame, evaluator, strongest_filter_param, weakest_filter_param, search);
+                    continue;
+                }
+
+                // フィルタが弱くて、簡単な条件で、黒帯が出るなら、しょうが無いからこれを採用
+                if (evaluator.hasBlackSpace(frame, weakest_filter_param))
+                {
+                    filter_strength[frame] = weakest_filter_param;
+                }
+                // フィルタが強くて、すごく安定化された条件で、難しい条件で、黒帯が出ないなら、喜んでこれを採用
+                else if (!evaluator.hasBlackSpace(frame, strongest_filter_param))
+                {
+                    filter_strength[frame] = strongest_filter_param;
+                }
+                else
+                {
+                    filter_strength[frame] = bisectionMethod(frame, evaluator, strongest_filter_param, weakest_filter_param);
+                }
+            }
+            evaluations += evaluator.evaluations;
+            report(finished_frames += end - begin);
+        }, ThreadPool::Priority::Normal, 16);
+        gradientLimit(filter_strength, maximum_gradient_);
+    }
+    printf("\rFilter strength: %d / %d frames in %.1f seconds, %lu black space evaluations.                \r\n", frames, frames,
+           std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count(), (unsigned long)evaluations);
     //    std::cout << filter_strength << std::endl;
-    gradientLimit(filter_strength, maximum_gradient_);
 
     return (filter_strength);
 }
 
+/**
+ * @brief Smallest zoom of every frame which leaves no black space with a fixed filter strength.
+ * @details It is solved for each frame in closed form, without rendering, in parallel over frames.
+ **/
+Eigen::VectorXd VirtualGimbalManager::getMinimumZoom(FilterPtr filter, const SyncTable &sync_table, int32_t filter_strength)
+{
+    Eigen::VectorXd zoom(video_param->video_frames);
+    const BlackSpaceEvaluator prototype(measured_angular_velocity, video_param, filter, sync_table, 1.0);
+    ThreadPool::getInstance().parallelFor(0, zoom.rows(), [&](int32_t begin, int32_t end) {
+        BlackSpaceEvaluator evaluator(prototype);
+        for (int frame = begin; frame < end; ++frame)
+        {
+            zoom[frame] = evaluator.getMinimumZoom(frame, filter_strength);
+        }
+    }, ThreadPool::Priority::Normal, 16);
+    return zoom;
+}
+
+/**
+ * @brief Relative RMS deviation of the corrections of a recursive filter from the gaussian taps.
+ **/
+double VirtualGimbalManager::getRecursiveFilterDeviation(FilterPtr filter, int32_t filter_strength)
+{
+    return measured_angular_velocity->getRecursiveFilterDeviation(*filter, filter_strength);
+}
+
 std::shared_ptr<cv::VideoCapture> VirtualGimbalManager::getVideoCapture()
 {
     return std::make_shared<cv::VideoCapture>(video_param->video_file_name);
@@ -507,29 +587,207 @@ std::shared_ptr<cv::VideoCapture> VirtualGimbalManager::getVideoCapture()
 #define LAP_BEGIN //auto td1=std::chrono::system_clock::now();int line =__LINE__;
 #define LAP       // printf("\r\nDuration from L %d to %d is %ld\r\n", line,__LINE__, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now() - td1).count());line=__LINE__;td1=std::chrono::system_clock::now();
 
-void VirtualGimbalManager::spin(double zoom, FilterPtr filter, Eigen::VectorXd &filter_strength, std::vector<std::pair<int32_t, double>> &sync_table, bool show_image)
+/**
+ * @brief Image object of the frame buffer, cached while the buffer is recycled.
+ * @details An alias of the buffer is shared between frames since it always sees the latest pixels.
+ * Images are keyed by the cl_mem of the buffer, not by the UMat. A UMat discarded by the pool may be followed
+ * by a new one at the same address, while the cl_mem stays retained by its image and can't be reused.
+ * If the device can't make an alias, the image is a copy and it's made every frame.
+ **/
+static cv::ocl::Image2D getImage2D(std::map<void *, cv::ocl::Image2D> &images, const cv::UMat &umat, bool normalized)
+{
+    if (!cv::ocl::Image2D::canCreateAlias(umat))
+    {
+        return cv::ocl::Image2D(umat, normalized);
+    }
+    void *handle = umat.handle(cv::ACCESS_RW);
+    auto it = images.find(handle);
+    if (images.end() == it)
+    {
+        it = images.emplace(handle, cv::ocl::Image2D(umat, normalized, true)).first;
+    }
+    return it->second;
+}
+
+/**
+ * @brief Split the frame into tiles and render them one by one.
+ * @details A tile whose source region exceeds the image size limit of the device is split into quarters.
+ * @param [in] getSourceRect Region of the source frame which a tile needs.
+ * @param [in] renderTile Render a tile from its source region.
+ **/
+static void renderTiles(const cv::Rect &frame_rect, int tile, const cv::ocl::Device &device,
+                        std::function<cv::Rect(const cv::Rect &)> getSourceRect,
+                        std::function<void(const cv::Rect &, const cv::Rect &)> renderTile)
 {
+    const int minimum_tile = 16;
+    std::vector<cv::Rect> tiles;
+    for (int y = frame_rect.y; y < frame_rect.br().y; y += tile)
+    {
+        for (int x = frame_rect.x; x < frame_rect.br().x; x += tile)
+        {
+            tiles.push_back(cv::Rect(x, y, tile, tile) & frame_rect);
+        }
+    }
+    while (!tiles.empty())
+    {
+        cv::Rect dst_rect = tiles.back();
+        tiles.pop_back();
+        cv::Rect src_rect = getSourceRect(dst_rect);
+        if ((((size_t)src_rect.width > device.image2DMaxWidth()) || ((size_t)src_rect.height > device.image2DMaxHeight())) &&
+            (dst_rect.width > minimum_tile) && (dst_rect.height > minimum_tile))
+        {
+            int half_width = dst_rect.width / 2;
+            int half_height = dst_rect.height / 2;
+            tiles.push_back(cv::Rect(dst_rect.x, dst_rect.y, half_width, half_height));
+            tiles.push_back(cv::Rect(dst_rect.x + half_width, dst_rect.y, dst_rect.width - half_width, half_height));
+            tiles.push_back(cv::Rect(dst_rect.x, dst_rect.y + half_height, half_width, dst_rect.height - half_height));
+            tiles.push_back(cv::Rect(dst_rect.x + half_width, dst_rect.y + half_height, dst_rect.width - half_width, dst_rect.height - half_height));
+            continue;
+        }
+        renderTile(dst_rect, src_rect);
+    }
+}
 
-    // Prepare correction rotation matrix generator. This constructor run a thread.
-    MultiThreadRotationMatrixGenerator gen(video_param, filter, measured_angular_velocity, filter_strength, sync_table,queue_size_);
+void VirtualGimbalManager::spin(double zoom, FilterPtr filter, Eigen::VectorXd &filter_strength, const SyncTable &sync_table, bool show_image)
+{
 
-    // Prepare OpenCL
+    // Prepare OpenCL. If it is not available, render on CPU.
     cv::ocl::Context context;
-    cv::Mat mat_src = cv::Mat::zeros(video_param->camera_info->height_, video_param->camera_info->width_, CV_8UC4); // TODO:冗長なので書き換える
-    cv::UMat umat_src = mat_src.getUMat(cv::ACCESS_READ, cv::USAGE_ALLOCATE_DEVICE_MEMORY);
+    bool render_on_cpu = (RenderBackend::CPU == render_backend);
+    if (!render_on_cpu)
+    {
+        try
+        {
+            initializeCL(context);
+        }
+        catch (const char *)
+        {
+            if (RenderBackend::OpenCL == render_backend)
+            {
+                throw;
+            }
+            std::cout << "Render on CPU instead of OpenCL." << std::endl;
+            render_on_cpu = true;
+        }
+    }
+    // Frames larger than the image size limit of the device are rendered in tiles.
+    const cv::Rect frame_rect(0, 0, video_param->camera_info->width_, video_param->camera_info->height_);
+    int32_t tile = render_on_cpu ? 0 : tile_size;
+    if (!render_on_cpu && !tile && (FrameFormat::BGRA == frame_format) &&
+        (((size_t)frame_rect.width > context.device(0).image2DMaxWidth()) || ((size_t)frame_rect.height > context.device(0).image2DMaxHeight())))
+    {
+        tile = 1024;
+        std::cout << "The frame exceeds the image size limit of the device. Render in tiles." << std::endl;
+    }
+    if (tile && (WarpMode::Forward == warp_mode))
+    {
+        std::cerr << "Tiled rendering needs inverse or mesh warp mode." << std::endl << std::flush;
+        throw "Tiled rendering needs inverse or mesh warp mode.";
+    }
+    const char *function = kernel_function;
+    if (tile)
+    {
+        function = (WarpMode::Mesh == warp_mode) ? "stabilizer_function_mesh_tile" : "stabilizer_function_inverse_tile";
+    }
+
+    // CpuStabilizer also makes the mesh for the OpenCL mesh kernel, and the source region of tiles.
+    int32_t grid_size = (WarpMode::Mesh == warp_mode) ? mesh_grid_size : 0;
+    std::unique_ptr<CpuStabilizer> cpu_stabilizer;
+    if (render_on_cpu || grid_size || tile)
+    {
+        cpu_stabilizer.reset(new CpuStabilizer(video_param, zoom, grid_size));
+    }
+    if (!render_on_cpu && (WarpMode::Forward == warp_mode) && (FrameFormat::BGR == frame_format))
+    {
+        std::cerr << "Forward warp mode needs BGRA frames." << std::endl << std::flush;
+        throw "Forward warp mode needs BGRA frames.";
+    }
+    // Tiles are images.
+    bool packed_bgr = (FrameFormat::BGR == frame_format) && !tile;
+
+    // OpenCL kernels which rotate rays get a quaternion per row, expanded to the matrix in the kernel.
+    // The host side of the mesh, tiles and the CPU backend use matrices.
+    bool rotation_quaternion = !render_on_cpu && (WarpMode::Mesh != warp_mode) && !tile;
+    size_t rotation_size = video_param->camera_info->height_ * (rotation_quaternion ? 4 : 9);
+
+    // Prepare correction rotation matrix generator. This constructor submits blocks to the thread pool.
+    MultiThreadRotationMatrixGenerator gen(video_param, filter, measured_angular_velocity, filter_strength, sync_table, queue_size_, rotation_quaternion,
+                                           keyframe_tolerance / video_param->camera_info->fx_); // Pixel to radian
+    // Whole frames of tiled rendering stay on host memory, only tiles are on the device.
+    // Frames of the CPU backend stay on host memory as well, OpenCL is left enabled for the others.
+    getFramePool()->setFormat(frame_rect.size(), packed_bgr ? CV_8UC3 : CV_8UC4,
+                              (tile || render_on_cpu) ? cv::USAGE_ALLOCATE_HOST_MEMORY : cv::USAGE_ALLOCATE_DEVICE_MEMORY);
+    cv::Mat mesh;
+    double max_mesh_error = 0.0;
+    // The error costs as much as the mesh itself, so that it is checked on every mesh_error_interval frames.
+    const int mesh_error_interval = 30;
+    // Frames in flight on the device. Each of them has its own kernel and argument buffers.
+    size_t in_flight = (render_on_cpu || tile) ? 1 : std::max<size_t>(1, async_frames);
+    std::vector<cv::ocl::Kernel> kernels(in_flight);
+    std::vector<cv::UMat> umat_Rs(in_flight);
+    std::vector<cv::UMat> umat_meshes(in_flight);
+    std::vector<cv::Mat> mesh_uploads(in_flight); // Host copies of meshes being uploaded, mesh is overwritten by the next frame.
+    for (auto &umat_R : umat_Rs)
+    {
+        // Row matrices are uploaded into the same device buffer every time.
+        umat_R.create(rotation_size, 1, CV_32F, cv::USAGE_ALLOCATE_DEVICE_MEMORY);
+    }
+    // Arguments are written without blocking, so that the upload of a frame doesn't wait for the kernel of the frame before.
+    // The queue is in-order, the write runs before the kernel. The host memory must stay until the frame of the slot is finished.
+    auto upload = [&](const void *src, size_t bytes, cv::UMat &dst) {
+        cl_command_queue queue = (cl_command_queue)cv::ocl::Queue::getDefault().ptr();
+        if (CL_SUCCESS != clEnqueueWriteBuffer(queue, (cl_mem)dst.handle(cv::ACCESS_WRITE), CL_FALSE, 0, bytes, src, 0, NULL, NULL))
+        {
+            cout << "Failed enqueueing the upload..." << endl
+                 << flush;
+            throw "Failed enqueueing the upload...";
+        }
+    };
+    // Image objects of the recycled frame buffers.
+    std::map<void *, cv::ocl::Image2D> images;
+    // Device buffers of a tile. Source regions are copied to the top left of tile_src which grows to the largest region.
+    cv::UMat tile_src, tile_dst;
+    const int tile_margin = 2;
     cv::String build_opt;
-    initializeCL(context);
+    // Build the kernel once. The program is cached on disk for later runs.
+    if (!render_on_cpu)
+    {
+        if (rotation_quaternion)
+        {
+            build_opt += " -D ROTATION_QUATERNION";
+        }
+        if (rotation_size * sizeof(float) > context.device(0).maxConstantBufferSize())
+        {
+            build_opt += " -D ROTATION_GLOBAL";
+        }
+        for (auto &kernel : kernels)
+        {
+            getKernel(kernel_name, function, kernel, context, build_opt);
+        }
+    }
+    cv::Mat mat_src = cv::Mat::zeros(video_param->camera_info->height_, video_param->camera_info->width_, CV_8UC4); // TODO:冗長なので書き換える
+
+    // Forward warp looks up undistorted coordinates of pixels from the table made with the inverse distortion parameters.
+    cv::UMat umat_undistortion_table;
+    if (!render_on_cpu && (WarpMode::Forward == warp_mode))
+    {
+        if (!video_param->camera_info->undistortion_table_)
+        {
+            video_param->camera_info->undistortion_table_ = std::make_shared<UndistortionTable>(*video_param->camera_info);
+        }
+        video_param->camera_info->undistortion_table_->getTable().copyTo(umat_undistortion_table);
+    }
 
     // Open Video
-    reader_ = std::make_shared<MultiThreadVideoReader>(video_param->video_file_name,queue_size_);
+    reader_ = std::make_shared<MultiThreadVideoReader>(video_param->video_file_name,queue_size_, getFramePool());
     auto capture = getVideoCapture();
 
     // Stabilize every frames
     // std::vector<float> R(video_param->camera_info->height_ * 9); // lines * 3x3 matrix
-    float ik1 = video_param->camera_info->inverse_k1_;
-    float ik2 = video_param->camera_info->inverse_k2_;
-    float ip1 = video_param->camera_info->inverse_p1_;
-    float ip2 = video_param->camera_info->inverse_p2_;
+    float k1 = video_param->camera_info->k1_;
+    float k2 = video_param->camera_info->k2_;
+    float p1 = video_param->camera_info->p1_;
+    float p2 = video_param->camera_info->p2_;
     float fx = video_param->camera_info->fx_;
     float fy = video_param->camera_info->fy_;
     float cx = video_param->camera_info->cx_;
@@ -537,83 +795,35 @@ void VirtualGimbalManager::spin(double zoom, FilterPtr filter, Eigen::VectorXd &
 
     // cv::VideoWriter video_writer = cv::VideoWriter(MultiThreadVideoWriter::getOutputName(video_param->video_file_name.c_str()), cv::VideoWriter::fourcc('F', 'M', 'P', '4'), 23.97, cv::Size(video_param->camera_info->width_, video_param->camera_info->height_), true);
 
-    for (int frame = 0; frame <= video_param->video_frames; ++frame)
+    struct InFlightFrame
     {
-        // Read a frame image
-        // (*capture) >> umat_src;
-        // if(umat_src.empty()){
-        //     break;
-        // }
-        // cv::cvtColor(umat_src, umat_src, cv::COLOR_BGR2BGRA);
-        UMatPtr umat_src;
-        reader_->get(umat_src);
-        if (!umat_src)
+        UMatPtr src;
+        UMatPtr dst;
+        MatrixPtr R;    // Rotations uploaded without blocking, kept until the frame is finished.
+        cl_event event; // Marker after the kernel, or NULL if the frame is already rendered.
+    };
+    std::deque<InFlightFrame> frames_in_flight;
+
+    // Wait for the oldest frame, then show and write it. Returns false when user quits.
+    auto finishFrame = [&](InFlightFrame &f) -> bool {
+        if (f.event)
         {
-            break;
+            clWaitForEvents(1, &f.event);
+            clReleaseEvent(f.event);
+            f.event = NULL;
         }
-
-        LAP_BEGIN
-        MatrixPtr R;
-        gen.get(R);
-        LAP
-
-            // Calculate Rotation matrix for every line
-            // for (int row = 0, e = video_param->camera_info->height_; row < e; ++row)
-            // {
-            //     double time_in_row = video_param->getInterval() * frame + resampler_parameter_->start + video_param->camera_info->line_delay_ * (row - video_param->camera_info->height_ * 0.5);
-            //     Eigen::Map<Eigen::Matrix<float, 3, 3, Eigen::RowMajor>>(&R[row * 9], 3, 3) = measured_angular_velocity->getCorrectionQuaternion(time_in_row, filter(filter_strength(row)).getFilterCoefficient()).matrix().cast<float>();
-            // }
-            // Send arguments to kernel
-            cv::ocl::Image2D image(*umat_src);
-        LAP
-            UMatPtr umat_dst_ptr(new cv::UMat(mat_src.size(), CV_8UC4, cv::ACCESS_WRITE, cv::USAGE_ALLOCATE_DEVICE_MEMORY));
-        LAP
-            cv::ocl::Image2D image_dst(*umat_dst_ptr, false, true);
-        LAP
-            cv::Mat mat_R = cv::Mat(R->size(), 1, CV_32F, R->data());
-        LAP
-            cv::UMat umat_R = mat_R.getUMat(cv::ACCESS_READ, cv::USAGE_ALLOCATE_DEVICE_MEMORY);
-        LAP
-            cv::ocl::Kernel kernel;
-        getKernel(kernel_name, kernel_function, kernel, context, build_opt);
-        LAP
-            kernel.args(image, image_dst, cv::ocl::KernelArg::ReadOnlyNoSize(umat_R),
-                        (float)zoom,
-                        ik1,
-                        ik2,
-                        ip1,
-                        ip2,
-                        fx,
-                        fy,
-                        cx,
-                        cy);
-        size_t globalThreads[3] = {(size_t)mat_src.cols, (size_t)mat_src.rows, 1};
-        //size_t localThreads[3] = { 16, 16, 1 };
-        LAP bool success = kernel.run(3, globalThreads, NULL, true);
-        if (!success)
-        {
-            cout << "Failed running the kernel..." << endl
-                 << flush;
-            throw "Failed running the kernel...";
-        }
-        // cv::Mat bgr;
-        // cv::cvtColor(umat_dst, bgr, cv::COLOR_BGRA2BGR);
-        // video_writer << bgr;
-        LAP
-            // 画面に表示
-            if (show_image)
+        // 画面に表示
+        if (show_image)
         {
             cv::UMat small, small_src;
-            cv::resize(*umat_dst_ptr, small, cv::Size(), 0.5, 0.5);
-            // cv::resize(mat_for_writer,small,cv::Size(),0.5,0.5);
-            // mat_for_writer.release();
-            cv::resize(*umat_src, small_src, cv::Size(), 0.5, 0.5);
+            cv::resize(*f.dst, small, cv::Size(), 0.5, 0.5);
+            cv::resize(*f.src, small_src, cv::Size(), 0.5, 0.5);
             cv::imshow("Original", small_src);
             cv::imshow("Result", small);
             char key = cv::waitKey(1);
             if ('q' == key)
             {
-                break;
+                return false;
             }
             else if ('s' == key)
             {
@@ -621,19 +831,24 @@ void VirtualGimbalManager::spin(double zoom, FilterPtr filter, Eigen::VectorXd &
                 key = cv::waitKey(0);
                 if ('q' == key)
                 {
-                    cv::destroyAllWindows();
-                    return;
+                    return false;
                 }
             }
         }
 
+        reader_->release(f.src);
         if (writer_)
         {
-            writer_->push(umat_dst_ptr);
+            // Writer returns the buffer to the pool after writing.
+            writer_->push(f.dst);
         }
-        LAP
-            //Show fps
-            auto t4 = std::chrono::system_clock::now();
+        else
+        {
+            getFramePool()->release(f.dst);
+        }
+
+        //Show fps
+        auto t4 = std::chrono::system_clock::now();
         static auto t3 = t4;
         // 処理の経過時間
         double elapsedmicroseconds = std::chrono::duration_cast<std::chrono::microseconds>(t4 - t3).count();
@@ -643,10 +858,263 @@ void VirtualGimbalManager::spin(double zoom, FilterPtr filter, Eigen::VectorXd &
             fps = 0.05 * (1e6 / elapsedmicroseconds) + 0.95 * fps;
         }
         t3 = t4;
-        printf("fps:%4.2f\r", fps);
+        if (grid_size)
+        {
+            printf("fps:%4.2f mesh error:%2.3f px\r", fps, max_mesh_error);
+        }
+        else
+        {
+            printf("fps:%4.2f\r", fps);
+        }
         fflush(stdout);
+        return true;
+    };
+
+    bool quit = false;
+    for (int frame = 0; frame <= video_param->video_frames; ++frame)
+    {
+        // Read a frame image
+        UMatPtr umat_src;
+        reader_->get(umat_src);
+        if (!umat_src)
+        {
+            break;
+        }
+
+        LAP_BEGIN
+        MatrixPtr R;
+        gen.get(R);
+        LAP
+
+        UMatPtr umat_dst_ptr = getFramePool()->acquire();
+        LAP
+        if (grid_size)
+        {
+            cpu_stabilizer->generateMesh(*R, mesh);
+            if (0 == frame % mesh_error_interval)
+            {
+                max_mesh_error = std::max(max_mesh_error, cpu_stabilizer->getMeshError(*R, mesh));
+            }
+        }
+        cl_event event = NULL;
+        if (render_on_cpu)
+        {
+            if (grid_size)
+            {
+                cpu_stabilizer->warp(*umat_src, mesh, *umat_dst_ptr);
+            }
+            else
+            {
+                cpu_stabilizer->warp(*umat_src, *R, *umat_dst_ptr);
+            }
+        }
+        else
+        {
+            // The slot of this frame was freed when the frame in_flight before was finished.
+            size_t slot = frame % in_flight;
+            cv::ocl::Kernel &kernel = kernels[slot];
+            cv::UMat &umat_R = umat_Rs[slot];
+            cv::UMat &umat_mesh = umat_meshes[slot];
+            auto uploadMesh = [&]() {
+                cv::Mat &mesh_upload = mesh_uploads[slot];
+                mesh.copyTo(mesh_upload);
+                umat_mesh.create(mesh.size(), mesh.type(), cv::USAGE_ALLOCATE_DEVICE_MEMORY);
+                upload(mesh_upload.data, mesh_upload.total() * mesh_upload.elemSize(), umat_mesh);
+            };
+
+            // Send arguments to kernel
+            if (tile)
+            {
+                // A single slot, tiles are rendered synchronously. Nothing overlaps the upload.
+                if (grid_size)
+                {
+                    mesh.copyTo(umat_mesh);
+                }
+                else
+                {
+                    cv::Mat(R->size(), 1, CV_32F, R->data()).copyTo(umat_R);
+                }
+                renderTiles(frame_rect, tile, context.device(0), [&](const cv::Rect &dst_rect) {
+                    return grid_size ? cpu_stabilizer->getSourceRect(mesh, dst_rect, tile_margin) : cpu_stabilizer->getSourceRect(*R, dst_rect, tile_margin);
+                }, [&](const cv::Rect &dst_rect, const cv::Rect &src_rect) {
+                    cv::UMat dst_roi = (*umat_dst_ptr)(dst_rect);
+                    if (src_rect.empty())
+                    {
+                        dst_roi.setTo(cv::Scalar::all(0));
+                        return;
+                    }
+                    if ((tile_src.cols < src_rect.width) || (tile_src.rows < src_rect.height))
+                    {
+                        images.erase(tile_src.handle(cv::ACCESS_RW));
+                        tile_src.create(std::max(tile_src.rows, src_rect.height), std::max(tile_src.cols, src_rect.width), CV_8UC4, cv::USAGE_ALLOCATE_DEVICE_MEMORY);
+                    }
+                    if ((tile_dst.cols < tile) || (tile_dst.rows < tile))
+                    {
+                        images.erase(tile_dst.handle(cv::ACCESS_RW));
+                        tile_dst.create(tile, tile, CV_8UC4, cv::USAGE_ALLOCATE_DEVICE_MEMORY);
+                    }
+                    (*umat_src)(src_rect).copyTo(tile_src(cv::Rect(cv::Point(0, 0), src_rect.size())));
+                    cv::ocl::Image2D image = getImage2D(images, tile_src, true);
+                    cv::ocl::Image2D image_dst = getImage2D(images, tile_dst, true);
+                    if (grid_size)
+                    {
+                        kernel.args(image, image_dst, cv::ocl::KernelArg::PtrReadOnly(umat_mesh),
+                                    (int)mesh.cols,
+                                    (int)grid_size,
+                                    dst_rect.x, dst_rect.y,
+                                    src_rect.x, src_rect.y,
+                                    frame_rect.width, frame_rect.height);
+                    }
+                    else
+                    {
+                        kernel.args(image, image_dst, cv::ocl::KernelArg::PtrReadOnly(umat_R),
+                                    (float)zoom,
+                                    k1,
+                                    k2,
+                                    p1,
+                                    p2,
+                                    fx,
+                                    fy,
+                                    cx,
+                                    cy,
+                                    dst_rect.x, dst_rect.y,
+                                    src_rect.x, src_rect.y,
+                                    frame_rect.width, frame_rect.height);
+                    }
+                    size_t globalThreads[3] = {(size_t)dst_rect.width, (size_t)dst_rect.height, 1};
+                    if (!kernel.run(3, globalThreads, NULL, true))
+                    {
+                        cout << "Failed running the kernel..." << endl
+                             << flush;
+                        throw "Failed running the kernel...";
+                    }
+                    tile_dst(cv::Rect(cv::Point(0, 0), dst_rect.size())).copyTo(dst_roi);
+                });
+            }
+            else
+            {
+                if (packed_bgr)
+                {
+                    // Buffers are bound as they are, no image objects.
+                    if (WarpMode::Mesh == warp_mode)
+                    {
+                        uploadMesh();
+                        kernel.args(cv::ocl::KernelArg::ReadOnly(*umat_src), cv::ocl::KernelArg::WriteOnly(*umat_dst_ptr),
+                                    cv::ocl::KernelArg::PtrReadOnly(umat_mesh),
+                                    (int)mesh.cols,
+                                    (int)grid_size);
+                    }
+                    else
+                    {
+                        upload(R->data(), R->size() * sizeof(float), umat_R);
+                        kernel.args(cv::ocl::KernelArg::ReadOnly(*umat_src), cv::ocl::KernelArg::WriteOnly(*umat_dst_ptr),
+                                    cv::ocl::KernelArg::PtrReadOnly(umat_R),
+                                    (float)zoom,
+                                    k1,
+                                    k2,
+                                    p1,
+                                    p2,
+                                    fx,
+                                    fy,
+                                    cx,
+                                    cy);
+                    }
+                }
+                else if (WarpMode::Mesh == warp_mode)
+                {
+                    // Inverse and mesh mode sample with hardware bilinear filter, so that images are normalized.
+                    uploadMesh();
+                    kernel.args(getImage2D(images, *umat_src, true), getImage2D(images, *umat_dst_ptr, true),
+                                cv::ocl::KernelArg::PtrReadOnly(umat_mesh),
+                                (int)mesh.cols,
+                                (int)grid_size);
+                }
+                else if (WarpMode::Inverse == warp_mode)
+                {
+                    upload(R->data(), R->size() * sizeof(float), umat_R);
+                    kernel.args(getImage2D(images, *umat_src, true), getImage2D(images, *umat_dst_ptr, true),
+                                cv::ocl::KernelArg::PtrReadOnly(umat_R),
+                                (float)zoom,
+                                k1,
+                                k2,
+                                p1,
+                                p2,
+                                fx,
+                                fy,
+                                cx,
+                                cy);
+                }
+                else
+                {
+                    upload(R->data(), R->size() * sizeof(float), umat_R);
+                    kernel.args(getImage2D(images, *umat_src, false), getImage2D(images, *umat_dst_ptr, false),
+                                cv::ocl::KernelArg::PtrReadOnly(umat_R),
+                                (float)zoom,
+                                cv::ocl::KernelArg::PtrReadOnly(umat_undistortion_table),
+                                umat_undistortion_table.cols,
+                                umat_undistortion_table.rows,
+                                video_param->camera_info->undistortion_table_->getStep(),
+                                fx,
+                                fy,
+                                cx,
+                                cy);
+                }
+                size_t globalThreads[3] = {(size_t)mat_src.cols, (size_t)mat_src.rows, 1};
+                //size_t localThreads[3] = { 16, 16, 1 };
+                bool sync = (1 == in_flight);
+                bool success = kernel.run(3, globalThreads, NULL, sync);
+                if (!success)
+                {
+                    cout << "Failed running the kernel..." << endl
+                         << flush;
+                    throw "Failed running the kernel...";
+                }
+                if (!sync)
+                {
+                    // The queue is in-order, so that the marker completes with the kernel.
+                    cl_command_queue queue = (cl_command_queue)cv::ocl::Queue::getDefault().ptr();
+                    if (CL_SUCCESS != clEnqueueMarkerWithWaitList(queue, 0, NULL, &event))
+                    {
+                        cout << "Failed enqueueing the marker..." << endl
+                             << flush;
+                        throw "Failed enqueueing the marker...";
+                    }
+                    clFlush(queue);
+                }
+            }
+        }
+        LAP
+        frames_in_flight.push_back(InFlightFrame{std::move(umat_src), std::move(umat_dst_ptr), std::move(R), event});
+
+        // Frames leave in the order they were rendered.
+        if (frames_in_flight.size() >= in_flight)
+        {
+            quit = !finishFrame(frames_in_flight.front());
+            frames_in_flight.pop_front();
+            if (quit)
+            {
+                break;
+            }
+        }
         LAP
     }
+    for (auto &f : frames_in_flight)
+    {
+        if (!quit)
+        {
+            quit = !finishFrame(f);
+        }
+        else if (f.event)
+        {
+            clWaitForEvents(1, &f.event);
+            clReleaseEvent(f.event);
+        }
+    }
+    frames_in_flight.clear();
+    if (grid_size)
+    {
+        std::cout << std::endl << "Maximum mesh interpolation error: " << max_mesh_error << " px" << std::endl;
+    }
     cv::destroyAllWindows();
     return;
 }
@@ -654,9 +1122,18 @@ void VirtualGimbalManager::spin(double zoom, FilterPtr filter, Eigen::VectorXd &
 #undef LAP_BEGIN
 #undef LAP
 
+UMatPoolPtr VirtualGimbalManager::getFramePool()
+{
+    if (!frame_pool_)
+    {
+        frame_pool_ = std::make_shared<UMatPool>(cv::Size(video_param->camera_info->width_, video_param->camera_info->height_), CV_8UC4);
+    }
+    return frame_pool_;
+}
+
 void VirtualGimbalManager::enableWriter(const char *video_path)
 {
-    writer_ = std::make_shared<MultiThreadVideoWriter>(MultiThreadVideoWriter::getOutputName(video_path), *video_param,queue_size_);
+    writer_ = std::make_shared<MultiThreadVideoWriter>(MultiThreadVideoWriter::getOutputName(video_path), *video_param,queue_size_, getFramePool());
 }
 
 std::vector<std::pair<int32_t, double>> VirtualGimbalManager::getSyncTable(double period_in_second, int32_t width)
@@ -80,14 +80,17 @@ void plot(vector<cv::Vec3d> data, string title, string legend_x, string legend_y
 }
 
 void plot(vector<Eigen::Quaterniond> data, string title, string legend_x, string legend_y, string legend_z){
-    vector<double> x,y,z,index;
     //Refill
-    for(auto el:data){
-        Eigen::Vector3d vec = Quaternion2Vector(el);
-        x.push_back(vec[0]);
-        y.push_back(vec[1]);
-        z.push_back(vec[2]);
-    }
+    Eigen::MatrixX4d quaternions(data.size(), 4);
+    for(size_t i=0;i<data.size();i++){
+        quaternions.row(i) = data[i].coeffs().transpose();
+    }
+    Eigen::MatrixX3d vectors(data.size(), 3);
+    Quaternions2Vectors(quaternions, vectors);
+    vector<double> x(vectors.col(0).data(), vectors.col(0).data() + vectors.rows());
+    vector<double> y(vectors.col(1).data(), vectors.col(1).data() + vectors.rows());
+    vector<double> z(vectors.col(2).data(), vectors.col(2).data() + vectors.rows());
+    vector<double> index;
     index.resize(x.size());
     for(size_t i=0;i<index.size();i++){
         index[i] = static_cast<double>(i);